@@ -64,18 +64,51 @@ This library provides the following functions;
 - SLO_decode  -- decode the raw bytes of a SLO image from memory
 - SLO_write   -- encode and write a SLO file
 - SLO_encode  -- encode an rgba buffer into a SLO image in memory
+- SLO_encode64, SLO_decode64 -- the same with size_t sizes, for images of 2GB+
+- SLO_encode_into -- encode into a caller-provided buffer, see SLO_encode_bound
+- SLO_encode_parallel -- encode an rgba buffer into strips on multiple threads
+- SLO_encode_batch    -- encode many small images on multiple threads at once
+- SLO_decode_parallel -- decode the strips of a SLO image on multiple threads
+- SLO_decode_batch    -- decode many small images on multiple threads at once
+- SLO_decode_into -- decode a SLO image into a caller-provided buffer
+- SLO_decode_region -- decode only a rectangle of a SLO image
+- SLO_decode_scaled -- decode a SLO image shrunk by 2, 4 or 8, e.g. for thumbnails
+- SLO_encoder_*       -- encode an image row by row into a sink with bounded memory
+- SLO_decoder_*       -- decode an image row by row from input fed in pieces
+- SLO_measure_stats   -- count the chunks of each op in an encoded image
+- SLO_encode_ex, SLO_decode_ex, SLO_decoder_init_ex -- the same with an allocator
 
 See the function declaration below for the signature and more information.
 
 If you don't want/need the SLO_read and SLO_write functions, you can define
 SLO_NO_STDIO before including this library.
 
+On Unix-like systems SLO_read maps the file into memory and decodes it straight
+from the mapping. Elsewhere, or if you define SLO_NO_MMAP, it reads the file in
+pieces through the streaming decoder, so the file is never loaded as a whole.
+
 This library uses malloc() and free(). To supply your own malloc implementation
-you can define SLO_MALLOC and SLO_FREE before including this library.
+you can define SLO_MALLOC and SLO_FREE before including this library. To use a
+different allocator per call, e.g. an arena per thread or request, pass an
+SLO_allocator to the *_ex functions; SLO_arena_* and SLO_pool_* make one from a
+buffer of the caller's.
 
 This library uses memset() to zero-initialize the index. To supply your own
 implementation you can define SLO_ZEROARR before including this library.
 
+The functions that take a number of threads (SLO_encode_parallel,
+SLO_decode_parallel, SLO_decode_into, the *_ex, *_batch, SLO_decode_region and
+SLO_decode_scaled functions) use pthreads (or Win32 threads on Windows), so you
+may need to link with -pthread. No threads are kept between calls: each call
+starts its threads and joins them before it returns. If you define
+SLO_NO_THREADS before including this library, they are still available but run
+on the calling thread only.
+
+The decoder dequantizes and stores pixels, and the encoder finds the length of
+runs, with SSE4.1 or AVX2 on x86 (picked at runtime from the CPU features) and
+with NEON on ARM64. To build only the portable scalar code you can define
+SLO_NO_SIMD before including this library.
+
 
 -- Data Format
 
@@ -90,10 +123,61 @@ struct SLO_header_t {
 	uint8_t  colorspace; // 0 = sRGB with linear alpha, 1 = all channels linear
 };
 
+If bit 7 of the colorspace byte is set (SLO_HEADER_EXT), the header is followed
+by an extension block. The colorspace itself is only bit 0.
+
+struct SLO_header_ext_t {
+	uint8_t  size;         // number of extension bytes that follow
+	uint32_t strip_height; // rows per strip, 0 = not striped (BE)
+	uint8_t  quant_level;  // 0..3, see "Quantization" below
+	uint8_t  recon;        // 0..2, see "Quantization" below
+	uint8_t  index_bits;   // log2 of the long index size: 8 or 10, 6 = none
+};
+
+A decoder must skip extension bytes it does not know about. If the extension
+block is missing or ends before quant_level, the level is 1; if it ends before
+recon, recon is 0; if it ends before index_bits, index_bits is 6.
+
 Images are encoded row by row, left to right, top to bottom. The decoder and
 encoder start with {r: 0, g: 0, b: 0, a: 255} as the previous pixel value. An
 image is complete when all pixels specified by width * height have been covered.
 
+-- Strips
+
+If strip_height is not 0, the image is cut into ceil(height / strip_height)
+horizontal strips. The extension block is then followed by a table with one
+uint64_t (BE) per strip, holding the file offset of the strip's first chunk.
+Every strip starts from scratch: the previous pixel is reset to
+{r: 0, g: 0, b: 0, a: 255} and the index to all zeros. A strip's chunks end
+where the next strip begins; the last one ends at the end marker. Strips can
+therefore be en- and decoded independently of each other.
+
+-- Quantization
+
+The r, g, b channels are stored with their lowest bits dropped; alpha is always
+stored as is. The number of dropped bits per channel depends on the quant_level
+in the header:
+
+	level    r  g  b
+	0        0  0  0   (lossless)
+	1        1  1  1   (the original SLO format)
+	2        2  1  2
+	3        3  2  3
+
+All chunks and the index work on these quantized values. The decoder restores
+a channel by shifting it left by the same amount and adding an offset that
+depends on recon:
+
+	0  no offset; the encoder rounds to the nearest multiple of 1 << shift
+	   (levels 2 and 3) or cuts off the low bits (levels 0 and 1)
+	1  1 << (shift - 1), the middle of the range of values that were cut off
+	2  an ordered dither within that range, from the 4x4 Bayer matrix
+	   bayer[y % 4][x % 4] = {{0,8,2,10}, {12,4,14,6}, {3,11,1,9}, {15,7,13,5}}:
+	   ((bayer * 2 + 1) << shift) >> 5
+
+Channels with a shift of 0 never get an offset. With recon 1 and 2, the encoder
+always cuts off the low bits.
+
 Pixels are encoded as
  - a run of the previous pixel
  - an index into an array of previously seen pixels
@@ -112,6 +196,16 @@ The hash function for the index is:
 
 	index_position = (r * 3 + g * 5 + b * 7 + a * 11) % 64
 
+With an index_bits of 8 or 10 in the header, a second, long index of 256 or 1024
+entries is maintained alongside it. Each pixel is put into both arrays, into the
+long one at the position
+
+	long_position = (r * 3 + g * 5 + b * 7 + a * 11) % 256 (or % 1024)
+
+so it keeps colors that have been pushed out of the short one. Its positions are
+written as SLO_OP_INDEX_LONG, whose tags take the place of the four longest runs,
+so SLO_OP_RUN only covers 1..58 then.
+
 Each chunk starts with a 2- or 8-bit tag, followed by a number of data bits. The
 bit length of chunks is divisible by 8 - i.e. all chunks are byte aligned. All
 values encoded in these data bits have the most significant bit on the left.
@@ -121,6 +215,11 @@ presence of an 8-bit tag first.
 
 The byte stream's end is marked with 7 0x00 bytes followed a single 0x01 byte.
 
+The chunks of an image (or of each strip) cover exactly its pixels: a run that
+is still going at the last pixel is written out as SLO_OP_RUN like any other.
+Streams from older encoders may lack that final run; a decoder that runs out of
+chunks early repeats the last pixel for the rest of the image (or strip).
+
 
 The possible chunks are:
 
@@ -195,7 +294,23 @@ The alpha value remains unchanged from the previous pixel.
 
 The run-length is stored with a bias of -1. Note that the run-lengths 63 and 64
 (b111110 and b111111) are illegal as they are occupied by the SLO_OP_RGB and
-SLO_OP_RGBA tags.
+SLO_OP_RGBA tags. With an index_bits of 8 or 10, the run-lengths 59..62 are
+illegal as well; they are occupied by the SLO_OP_INDEX_LONG tags.
+
+
+.- SLO_OP_INDEX_LONG -------------------------------.
+|         Byte[0]         |         Byte[1]         |
+|  7  6  5  4  3  2  1  0 |  7  6  5  4  3  2  1  0 |
+|-------------------------+-------------------------|
+|   tag 0xfa..0xfd        |         index lo        |
+`---------------------------------------------------`
+8-bit tags b11111010..b11111101, only with an index_bits of 8 or 10
+10-bit index into the long index array: (tag & 3) << 8 | Byte[1]
+
+The high two bits of the index are the low two bits of the tag, hi = tag & 3,
+so 0xfc and 0xfd hold hi 0 and 1, 0xfa and 0xfb hold hi 2 and 3.
+
+With an index_bits of 8, the index must be below 256.
 
 
 .- SLO_OP_RGB ------------------------------------------.
@@ -233,6 +348,8 @@ Header - Public functions */
 #ifndef SLO_H
 #define SLO_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -242,31 +359,171 @@ It describes either the input format (for SLO_write and SLO_encode), or is
 filled with the description read from the file header (for SLO_read and
 SLO_decode).
 
+For encoding, zero the whole struct before filling it in, e.g. with
+SLO_desc desc = {0}; or memset. Only width, height, channels and colorspace
+are required; every other field selects an option whose default is 0, so a
+struct that is left uninitialized encodes with whatever those bytes hold, or
+is rejected.
+
 The colorspace in this SLO_desc is an enum where
 	0 = sRGB, i.e. gamma scaled RGB channels and a linear alpha channel
 	1 = all channels are linear
 You may use the constants SLO_SRGB or SLO_LINEAR. The colorspace is purely
 informative. It will be saved to the file header, but does not affect
-how chunks are en-/decoded. */
+how chunks are en-/decoded.
+
+The strip_height splits the image into horizontal strips of that many rows,
+each of which is encoded independently of the others (see "Strips" below).
+0 = the image is encoded as a single stream.
+
+The quality selects how many low bits of r, g, b are dropped (see
+"Quantization" below), trading image quality for size:
+	SLO_QUALITY_DEFAULT  = 0, the same as SLO_QUALITY_NORMAL
+	SLO_QUALITY_LOSSLESS = 1, nothing is dropped
+	SLO_QUALITY_NORMAL   = 2, 1 bit per channel, the original SLO format
+	SLO_QUALITY_LOW      = 3, 2 bits of red and blue, 1 of green
+	SLO_QUALITY_LOWEST   = 4, 3 bits of red and blue, 2 of green
+When decoding, it is set to the quality the image was encoded with (never 0).
+
+The recon selects how the decoder fills in the dropped bits:
+	SLO_RECON_SHIFT    = 0, with zeros. The encoder rounds each channel, so
+	                     that this is the nearest value. With
+	                     SLO_QUALITY_NORMAL it cuts the bit off instead, so
+	                     the output stays byte for byte what encoders that
+	                     predate recon wrote for the same image.
+	SLO_RECON_MIDPOINT = 1, with the middle of the range of dropped values
+	SLO_RECON_DITHER   = 2, with an ordered dither over that range. This has a
+	                     somewhat higher error than SLO_RECON_MIDPOINT, but
+	                     hides the banding of smooth gradients at low quality.
+Decoders that predate recon treat every image as SLO_RECON_SHIFT.
+
+The index_size is the number of recently seen colors the en-/decoder keep: 64
+(or 0, the default), 256 or 1024. Anything above 64 adds a long index, which
+helps images that keep coming back to the same few hundred colors, like
+screenshots, charts and sprites: a color that has fallen out of the 64 entry
+index can still be sent in 2 bytes instead of 4 or 5. On a lossless corpus a
+long index of 256 entries gives 88% of the size, 1024 entries 85%. Decoding
+gets a little faster, as there are fewer bytes to read, but decoders that
+predate it misread such images. When decoding, it is set to the index size of
+the image (never 0).
+
+A tolerance other than 0 makes the encoder accept near matches: a pixel may be
+sent as a run, index or diff chunk if its r, g, b after quantization differ by
+at most tolerance (in 8 bit units, i.e. before the shift) from what the decoder
+will produce. Of the chunks that are close enough, the encoder takes the
+smallest. At a tolerance of 2 to 4 this typically saves 15-30%, but makes the
+encoder 2-3 times slower. Alpha is always exact. A tolerance below the step of
+every channel (2 with SLO_QUALITY_NORMAL) allows no error after quantization,
+so the encoder then only takes exact matches, at full speed.
+
+If bounded is set, the encoder instead guarantees that no channel of the
+decoded image differs from the input by more than max_abs_error (r, g, b, a),
+and accepts near matches wherever that allows. The tolerance is ignored then.
+The bound includes the error of the quantization, so the quality and recon have
+to allow for it: with SLO_QUALITY_LOSSLESS any bound works, with
+SLO_QUALITY_NORMAL the bound for r, g, b has to be at least 1, etc. Encoding
+fails if the bound can't be met. The encoder decodes its output again and checks
+it with SLO_measure_error before returning it; the streaming encoder can't, as
+it doesn't keep the input.
+
+The tolerance, bounded and max_abs_error are not stored in the file and are 0
+after decoding. */
 
 #define SLO_SRGB   0
 #define SLO_LINEAR 1
 
+#define SLO_QUALITY_DEFAULT  0
+#define SLO_QUALITY_LOSSLESS 1
+#define SLO_QUALITY_NORMAL   2
+#define SLO_QUALITY_LOW      3
+#define SLO_QUALITY_LOWEST   4
+
+#define SLO_RECON_SHIFT    0
+#define SLO_RECON_MIDPOINT 1
+#define SLO_RECON_DITHER   2
+
 typedef struct {
 	unsigned int width;
 	unsigned int height;
 	unsigned char channels;
 	unsigned char colorspace;
+	unsigned int strip_height;
+	unsigned char quality;
+	unsigned char recon;
+	unsigned char tolerance;
+	unsigned char bounded;
+	unsigned char max_abs_error[4];
+	unsigned short index_size;
 } SLO_desc;
 
+typedef union {
+	struct { unsigned char r, g, b, a; } rgba;
+	unsigned int v;
+} SLO_rgba_t;
+
+/* The state that is carried from one pixel to the next: the indexes of
+previously seen pixels, the previous pixel and the pending run length. It is only public
+so that the streaming en-/decoders can be allocated by the caller. */
+
+#define SLO_INDEX_MAX 1024
+
+typedef struct {
+	SLO_rgba_t index[64];
+	SLO_rgba_t index_long[SLO_INDEX_MAX];
+	SLO_rgba_t px;
+	int run;
+	int long_mask;  /* index_long size - 1, 0 if there is none */
+} SLO_state;
+
+/* An allocator for the *_ex functions. alloc(user, size) returns NULL on
+failure, free(user, ptr) is never called with NULL. Memory only ever is
+allocated and freed on the calling thread, also by the functions that use more
+threads, so the allocator needn't be thread safe. The one exception are bounded
+images in SLO_encode_batch, see there. A NULL SLO_allocator pointer stands for
+SLO_MALLOC and SLO_FREE. */
+
+typedef struct {
+	void *(*alloc)(void *user, size_t size);
+	void (*free)(void *user, void *ptr);
+	void *user;
+} SLO_allocator;
+
+/* A bump allocator over a buffer of the caller's. free does nothing; all of
+the memory is handed out again after SLO_arena_reset. SLO_arena_allocator
+returns an allocator that takes from the arena, which has to outlive it. */
+
+typedef struct {
+	unsigned char *base;
+	size_t capacity;
+	size_t used;
+} SLO_arena;
+
+void SLO_arena_init(SLO_arena *arena, void *buffer, size_t capacity);
+void SLO_arena_reset(SLO_arena *arena);
+SLO_allocator SLO_arena_allocator(SLO_arena *arena);
+
+/* A pool of blocks of block_size bytes, cut from a buffer of the caller's.
+Allocations larger than a block fail. Freed blocks are reused right away, so
+a pool with a few blocks of the largest size serves any number of calls. */
+
+typedef struct {
+	void *free_list;
+	size_t block_size;
+} SLO_pool;
+
+void SLO_pool_init(SLO_pool *pool, void *buffer, size_t capacity, size_t block_size);
+SLO_allocator SLO_pool_allocator(SLO_pool *pool);
+
 #ifndef SLO_NO_STDIO
 
 /* Encode raw RGB or RGBA pixels into a SLO image and write it to the file
-system. The SLO_desc struct must be filled with the image width, height,
-number of channels (3 = RGB, 4 = RGBA) and the colorspace.
+system. The SLO_desc struct must be zeroed and filled with the image width,
+height, number of channels (3 = RGB, 4 = RGBA) and the colorspace; see SLO_desc
+for the optional fields.
 
-The function returns 0 on failure (invalid parameters, or fopen or malloc
-failed) or the number of bytes written on success. */
+The function returns 0 on failure (invalid parameters, or fopen, fwrite or
+malloc failed) or the number of bytes written on success. Files of 2GB or more
+are written fine, but the return value is clamped to INT_MAX. */
 
 int SLO_write(const char *filename, const void *data, const SLO_desc *desc);
 
@@ -279,6 +536,9 @@ The function either returns NULL on failure (invalid data, or malloc or fopen
 failed) or a pointer to the decoded pixels. On success, the SLO_desc struct
 will be filled with the description from the file header.
 
+The file is decoded from a memory mapping where possible, otherwise it is read
+in pieces; in either case no copy of the whole file is made.
+
 The returned pixel data should be free()d after use. */
 
 void *SLO_read(const char *filename, SLO_desc *desc, int channels);
@@ -286,15 +546,156 @@ void *SLO_read(const char *filename, SLO_desc *desc, int channels);
 #endif /* SLO_NO_STDIO */
 
 
-/* Encode raw RGB or RGBA pixels into a SLO image in memory.
+/* Encode raw RGB or RGBA pixels into a SLO image in memory. The SLO_desc is
+set up as for SLO_write: zeroed, then the width, height, channels, colorspace
+and any of the optional fields filled in.
 
 The function either returns NULL on failure (invalid parameters or malloc
 failed) or a pointer to the encoded data on success. On success the out_len
 is set to the size in bytes of the encoded data.
 
+SLO_encode also fails if the encoded data would be 2GB or larger. SLO_encode64
+is the same function with a size_t out_len and no such limit.
+
 The returned SLO data should be free()d after use. */
 
 void *SLO_encode(const void *data, const SLO_desc *desc, int *out_len);
+void *SLO_encode64(const void *data, const SLO_desc *desc, size_t *out_len);
+
+
+/* SLO_encode64 with all memory taken from the given allocator (NULL = SLO_MALLOC),
+including the returned data, which has to be freed with it. The strips of a
+desc with a strip_height are encoded on up to the given number of threads
+(0 = one per CPU). */
+
+void *SLO_encode_ex(
+	const void *data, const SLO_desc *desc, size_t *out_len, int threads,
+	const SLO_allocator *allocator
+);
+
+
+/* Encode raw RGB or RGBA pixels into a buffer owned by the caller, so that a
+pooled buffer can be reused for many images without any allocation. Only a
+bounded desc still allocates: its output is decoded again to check the bound,
+which takes a row of pixels.
+
+SLO_encode_bound returns the worst case encoded size for the image described
+by desc, or 0 if desc is invalid. SLO_encode_into never runs out of space in a
+buffer of that size. A smaller buffer is tried as well (except for striped
+images), since the actual output is usually much smaller.
+
+SLO_encode_into returns the number of bytes written, SLO_ENCODE_MORE_SPACE if
+the buffer was too small (its content is undefined then; a buffer of
+SLO_encode_bound bytes will do), or 0 on failure: invalid parameters, or for a
+bounded desc, a failed malloc or a bound that wasn't met. SLO_encode_into_ex
+takes the memory for checking the bound from the given allocator
+(NULL = SLO_MALLOC) instead. */
+
+#define SLO_ENCODE_MORE_SPACE ((size_t)-1)
+
+size_t SLO_encode_bound(const SLO_desc *desc);
+size_t SLO_encode_into(const void *data, const SLO_desc *desc, void *buffer, size_t capacity);
+size_t SLO_encode_into_ex(
+	const void *data, const SLO_desc *desc, void *buffer, size_t capacity,
+	const SLO_allocator *allocator
+);
+
+
+/* Encode raw RGB or RGBA pixels into a striped SLO image in memory, using up
+to the given number of threads (0 = one per CPU). The strips are encoded
+concurrently and stitched together behind the strip offset table.
+
+If desc->strip_height is 0, a strip height is picked from the image size
+alone, so the output does not depend on the number of threads.
+
+Return value and ownership are the same as for SLO_encode. */
+
+void *SLO_encode_parallel(const void *data, const SLO_desc *desc, size_t *out_len, int threads);
+
+
+/* Encode count images at once, e.g. thumbnails, on up to the given number of
+threads (0 = one per CPU). All of the output is packed into a single buffer,
+which is taken from the allocator (NULL = SLO_MALLOC) and has to be freed with
+it: image i is bytes offsets[i] up to offsets[i + 1], so offsets must have room
+for count + 1 entries.
+
+The buffer is allocated once, with room for the worst case size of every
+image (see SLO_encode_bound), a bit over (channels + 1) / channels times the
+size of the pixels, and the images are encoded straight into it. The threads
+are started once per call. The images are split into a few runs of consecutive
+images per thread, with about the same worst case size; each thread takes the
+next run as soon as it is done with one, so runs that encode faster than others
+still balance. The images of a run are packed behind each other, and at the
+end the runs are moved together. On a single thread there is one run, so
+nothing is moved. The buffer stays its full size, but the pages behind the
+output are never touched, so most systems don't commit them.
+
+An image that can't be encoded (invalid desc or pixels, or a bound that isn't
+met) is left empty, offsets[i] == offsets[i + 1], without failing the others.
+Returns NULL only if memory can't be allocated. The strips of striped images
+are encoded one after the other, by the thread that has the image. Checking
+the bound of a bounded image needs memory, which the worker threads take from
+SLO_MALLOC instead of the allocator, as that needn't be thread safe. */
+
+typedef struct {
+	const void *pixels;
+	SLO_desc desc;
+} SLO_encode_item;
+
+void *SLO_encode_batch(
+	const SLO_encode_item *items, int count, size_t *offsets, int threads,
+	const SLO_allocator *allocator
+);
+
+
+/* Streaming encoder. Instead of taking the whole image at once, pixels are
+pushed a few rows at a time and the encoded bytes are handed to a sink as soon
+as SLO_ENCODER_BUFFER bytes have accumulated. Apart from that buffer only the
+SLO_state is kept, so neither the input image nor the output file ever has to
+exist in memory in full.
+
+	SLO_encoder enc;
+	SLO_encoder_init(&enc, &desc, my_write, my_file);
+	while (have_rows) {
+		SLO_encoder_push_rows(&enc, rows, row_count, stride);
+	}
+	SLO_encoder_finish(&enc);
+
+The sink is called as write(user, bytes, size) and returns 0 on failure.
+SLO_encoder_init_buffer writes into a fixed size buffer instead and fails once
+it is full.
+
+Striped images need the strip table before the first chunk and can't be
+streamed; the desc must have a strip_height of 0.
+
+All of these functions return 0 on failure. Once a call has failed, all
+further calls on the same encoder fail as well. SLO_encoder_push_rows takes
+rows that are stride bytes apart (0 = width * channels). SLO_encoder_finish
+fails if fewer than height rows have been pushed; on success enc.len holds the
+total number of bytes written. */
+
+#define SLO_ENCODER_BUFFER 4096
+
+typedef int (*SLO_write_fn)(void *user, const void *data, int size);
+
+typedef struct {
+	SLO_desc desc;
+	SLO_write_fn write;
+	void *user;
+	unsigned char *out;
+	size_t out_capacity;
+	unsigned int rows;
+	unsigned long long len;
+	int error;
+	SLO_state state;
+	int buffer_len;
+	unsigned char buffer[SLO_ENCODER_BUFFER];
+} SLO_encoder;
+
+int SLO_encoder_init(SLO_encoder *enc, const SLO_desc *desc, SLO_write_fn write, void *user);
+int SLO_encoder_init_buffer(SLO_encoder *enc, const SLO_desc *desc, void *buffer, size_t capacity);
+int SLO_encoder_push_rows(SLO_encoder *enc, const void *rows, int count, size_t stride);
+int SLO_encoder_finish(SLO_encoder *enc);
 
 
 /* Decode a SLO image from memory.
@@ -303,9 +704,234 @@ The function either returns NULL on failure (invalid parameters or malloc
 failed) or a pointer to the decoded pixels. On success, the SLO_desc struct
 is filled with the description from the file header.
 
+SLO_decode64 is the same function with a size_t size, for encoded data of 2GB
+or more.
+
 The returned pixel data should be free()d after use. */
 
 void *SLO_decode(const void *data, int size, SLO_desc *desc, int channels);
+void *SLO_decode64(const void *data, size_t size, SLO_desc *desc, int channels);
+
+
+/* Decode a SLO image from memory, using up to the given number of threads
+(0 = one per CPU). The strips of a striped image are decoded concurrently,
+each directly into its own rows of the output. Images without strips are
+decoded on the calling thread.
+
+Return value and ownership are the same as for SLO_decode. */
+
+void *SLO_decode_parallel(const void *data, size_t size, SLO_desc *desc, int channels, int threads);
+
+
+/* SLO_decode_parallel with all memory taken from the given allocator
+(NULL = SLO_MALLOC), including the returned pixels, which have to be freed
+with it. */
+
+void *SLO_decode_ex(
+	const void *data, size_t size, SLO_desc *desc, int channels, int threads,
+	const SLO_allocator *allocator
+);
+
+
+/* Decode count images at once, e.g. the sprites of an atlas, on up to the
+given number of threads (0 = one per CPU). The pixels of all images go into a
+single buffer, which is taken from the allocator (NULL = SLO_MALLOC) and has to
+be freed with it. The caller fills in data and size of each item; the rest is
+set by SLO_decode_batch: on success, ok is 1, desc is read from the header and
+the image's rows (width * channels bytes each, no padding) start at offset in
+the buffer. Images with invalid data have ok set to 0 and take no space, and
+don't fail the others.
+
+Channels works like for SLO_decode, for all images. Returns NULL only if the
+buffer can't be allocated. */
+
+typedef struct {
+	const void *data;
+	size_t size;
+	SLO_desc desc;
+	size_t offset;
+	int ok;
+} SLO_decode_item;
+
+void *SLO_decode_batch(
+	SLO_decode_item *items, int count, int channels, int threads,
+	const SLO_allocator *allocator
+);
+
+
+/* Decode a SLO image from memory into a buffer owned by the caller, e.g. a
+pooled, aligned or mapped frame. Rows are written stride bytes apart
+(0 = width * channels); the padding between rows is left untouched. The buffer
+of pixels_size bytes must hold (height - 1) * stride + width * channels bytes.
+SLO_decode_header only reads the header, to find the size of the buffer.
+
+Channels and threads are the same as for SLO_decode_parallel. Both functions
+return 1 on success and fill the SLO_desc struct, or 0 on failure (invalid
+data or a buffer that is too small). */
+
+int SLO_decode_header(const void *data, size_t size, SLO_desc *desc);
+int SLO_decode_into(
+	const void *data, size_t size, SLO_desc *desc, int channels,
+	void *pixels, size_t pixels_size, size_t stride, int threads
+);
+
+
+/* Decode only the rectangle of w * h pixels at x, y of a SLO image from
+memory, e.g. a crop or the top rows for a preview. The chunks are decoded up
+to the last pixel of the rectangle, and only the pixels inside it are stored.
+Of a striped image, only the strips that intersect the rectangle are decoded,
+on up to the given number of threads (0 = one per CPU); the rectangle's rows
+near the top of a strip are the cheapest then.
+
+The function either returns NULL on failure (invalid data, a rectangle that
+isn't inside the image, or malloc failed) or a pointer to the w * h pixels,
+with channels like for SLO_decode. On success, the SLO_desc struct is filled
+with the description of the whole image.
+
+The returned pixel data should be free()d after use. SLO_decode_region_ex
+takes them from the given allocator (NULL = SLO_MALLOC) instead, and they have
+to be freed with it. */
+
+void *SLO_decode_region(
+	const void *data, size_t size, SLO_desc *desc, int channels,
+	unsigned int x, unsigned int y, unsigned int w, unsigned int h, int threads
+);
+void *SLO_decode_region_ex(
+	const void *data, size_t size, SLO_desc *desc, int channels,
+	unsigned int x, unsigned int y, unsigned int w, unsigned int h, int threads,
+	const SLO_allocator *allocator
+);
+
+
+/* Decode a SLO image from memory shrunk by a scale of 1, 2, 4 or 8 in both
+directions: each output pixel is the rounded average of a scale * scale block
+of the image (fewer at the right and bottom edges). The image is
+(desc->width + scale - 1) / scale by (desc->height + scale - 1) / scale pixels.
+The blocks are summed up while the chunks are decoded, so the image is never
+there in full size: besides the output only a row of sums is kept.
+
+The strips of a striped image are decoded on up to the given number of threads
+(0 = one per CPU), if the strip_height is a multiple of the scale; otherwise a
+block could span two strips and they are decoded in order.
+
+Return value, channels, desc and ownership are the same as for SLO_decode;
+desc describes the full size image. SLO_decode_scaled_ex takes all memory from
+the given allocator (NULL = SLO_MALLOC), including the returned pixels, which
+have to be freed with it; the rows of sums of all threads are allocated before
+the threads start. */
+
+void *SLO_decode_scaled(const void *data, size_t size, SLO_desc *desc, int channels, int scale, int threads);
+void *SLO_decode_scaled_ex(
+	const void *data, size_t size, SLO_desc *desc, int channels, int scale, int threads,
+	const SLO_allocator *allocator
+);
+
+
+/* Decode a SLO image of size bytes and compare it to the pixels it was encoded
+from, which must have as many channels as the image. The largest difference of
+each channel (r, g, b, a) is stored in max_error; for RGB images max_error[3]
+is 0. The image is decoded row by row, so no memory for a copy of it is needed.
+
+Returns 1 on success, or 0 for invalid data or if malloc failed. */
+
+int SLO_measure_error(const void *data, size_t size, const void *pixels, unsigned char *max_error);
+
+
+/* Count the chunks of each op in a SLO image of size bytes, e.g. to see why an
+image compresses poorly. For each op, stats->chunks holds the number of its
+chunks, stats->bytes their size including the tag and stats->pixels the number
+of pixels they cover. header_bytes is everything before the first chunk,
+including the strip table; the 8 byte end marker is counted in none of them.
+
+From these follow e.g. the share of pixels taken from an index,
+	(pixels[SLO_STAT_INDEX] + pixels[SLO_STAT_INDEX_LONG]) / (width * height)
+or the average run length, pixels[SLO_STAT_RUN] / chunks[SLO_STAT_RUN].
+
+Only the chunks are read, nothing is decoded. Returns 1 on success and fills
+the SLO_desc struct, or 0 for invalid data. */
+
+#define SLO_STAT_INDEX      0
+#define SLO_STAT_INDEX_LONG 1
+#define SLO_STAT_DIFF       2
+#define SLO_STAT_LUMA       3
+#define SLO_STAT_RUN        4
+#define SLO_STAT_RGB        5
+#define SLO_STAT_RGBA       6
+#define SLO_STAT_OPS        7
+
+typedef struct {
+	unsigned long long chunks[SLO_STAT_OPS];
+	unsigned long long bytes[SLO_STAT_OPS];
+	unsigned long long pixels[SLO_STAT_OPS];
+	unsigned long long header_bytes;
+} SLO_stats;
+
+int SLO_measure_stats(const void *data, size_t size, SLO_desc *desc, SLO_stats *stats);
+
+
+/* Streaming decoder. The encoded bytes are fed in pieces of any size, e.g. as
+they arrive from a socket, and the decoded image is pulled out a few rows at a
+time. Besides SLO_DECODER_BUFFER bytes of input, the decoder only keeps one
+row of pixels (and the strip table of a striped image).
+
+	SLO_decoder dec;
+	SLO_decoder_init(&dec, 4);
+	do {
+		len = fread(buf, 1, sizeof(buf), f);
+		used = 0;
+		do {
+			used += SLO_decoder_feed(&dec, buf + used, len - used);
+			while (SLO_decoder_read_rows(&dec, row, 1, 0) == 1) {
+				consume(row);
+			}
+		} while (used < len);
+	} while (len > 0);
+	SLO_decoder_free(&dec);
+
+SLO_decoder_feed copies as much of the data as fits into the input buffer and
+returns the number of bytes taken; the rest has to be fed again after reading
+some rows. A size of 0 marks the end of the input. Returns -1 on failure.
+
+SLO_decoder_read_rows decodes up to count rows into out, stride bytes apart
+(0 = width * channels), and returns the number of rows written. It returns
+fewer rows than requested if it needs more input or the image is complete
+(dec.rows == dec.desc.height), and -1 for invalid data or if malloc failed.
+
+Once the header has been read (dec.header is set), dec.desc describes the
+image and the output rows can be allocated. The channels given to
+SLO_decoder_init work like for SLO_decode. SLO_decoder_free releases the row
+buffer and strip table. SLO_decoder_init_ex allocates them with the given
+allocator instead, which has to outlive the decoder. */
+
+#define SLO_DECODER_BUFFER 4096
+
+typedef struct {
+	SLO_desc desc;
+	int channels;
+	int header;
+	int error;
+	int eof;
+	unsigned int rows;
+	unsigned int x;
+	int strip;
+	int table_len;
+	int table_cap;
+	unsigned long long *table;
+	unsigned long long skip;
+	unsigned long long offset;
+	unsigned char *row;
+	const SLO_allocator *allocator;
+	SLO_state state;
+	int pos;
+	int len;
+	unsigned char buffer[SLO_DECODER_BUFFER];
+} SLO_decoder;
+
+int SLO_decoder_init(SLO_decoder *dec, int channels);
+int SLO_decoder_init_ex(SLO_decoder *dec, int channels, const SLO_allocator *allocator);
+int SLO_decoder_feed(SLO_decoder *dec, const void *data, size_t size);
+int SLO_decoder_read_rows(SLO_decoder *dec, void *out, int count, size_t stride);
+void SLO_decoder_free(SLO_decoder *dec);
 
 
 #ifdef __cplusplus
@@ -320,6 +946,7 @@ Implementation */
 #ifdef SLO_IMPLEMENTATION
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #ifndef SLO_MALLOC
 	#define SLO_MALLOC(sz) malloc(sz)
@@ -329,6 +956,17 @@ Implementation */
 	#define SLO_ZEROARR(a) memset((a),0,sizeof(a))
 #endif
 
+/* Generic kernels take the pixel format as constant arguments and are only
+called from small wrappers, one per format. Inlining them turns each wrapper
+into a loop specialized for its format. */
+#if defined(_MSC_VER)
+	#define SLO_FORCE_INLINE static __forceinline
+#elif defined(__GNUC__)
+	#define SLO_FORCE_INLINE static __inline__ __attribute__((always_inline))
+#else
+	#define SLO_FORCE_INLINE static
+#endif
+
 #define SLO_OP_INDEX  0x00 /* 00xxxxxx */
 #define SLO_OP_DIFF   0x40 /* 01xxxxxx */
 #define SLO_OP_LUMA   0x80 /* 10xxxxxx */
@@ -336,6 +974,12 @@ Implementation */
 #define SLO_OP_RGB    0xfe /* 11111110 */
 #define SLO_OP_RGBA   0xff /* 11111111 */
 
+#define SLO_OP_INDEX_LONG 0xfa /* 0xfa..0xfd, index bits 9..8 = tag & 3 */
+
+/* The tag for long index position pos. 0xfa & 3 is 2, so bits 9..8 of pos are
+rotated by 2 for tag & 3 to come out as pos >> 8. */
+#define SLO_OP_INDEX_LONG_TAG(pos) (SLO_OP_INDEX_LONG + (((pos) >> 8) + 2) % 4)
+
 #define SLO_MASK_2    0xc0 /* 11000000 */
 
 #define SLO_COLOR_HASH(C) (C.rgba.r*3 + C.rgba.g*5 + C.rgba.b*7 + C.rgba.a*11)
@@ -343,324 +987,3367 @@ Implementation */
 	(((unsigned int)'s') << 24 | ((unsigned int)'l') << 16 | \
 	 ((unsigned int)'o') <<  8 | ((unsigned int)'f'))
 #define SLO_HEADER_SIZE 14
+#define SLO_HEADER_EXT  0x80 /* colorspace flag: an extension block follows */
+#define SLO_EXT_SIZE    7    /* size of the extension fields written by us */
+#define SLO_EXT_MIN     4    /* extension blocks must hold the strip_height */
+#define SLO_LEVELS      4
+
+/* Bits dropped from r, g, b per quantization level */
+static const unsigned char SLO_shifts[SLO_LEVELS][3] = {
+	{0, 0, 0},
+	{1, 1, 1},
+	{2, 1, 2},
+	{3, 2, 3}
+};
 
-/* 2GB is the max file size that this implementation can safely handle. We guard
-against anything larger than that, assuming the worst case with 5 bytes per
-pixel, rounded down to a nice clean value. 400 million pixels ought to be
-enough for anybody. */
-#define SLO_PIXELS_MAX ((unsigned int)400000000)
+#define SLO_LEVEL(desc) ((desc)->quality ? (desc)->quality - 1 : 1)
+#define SLO_INDEX_SIZE(desc) ((desc)->index_size ? (desc)->index_size : 64)
 
-typedef union {
-	struct { unsigned char r, g, b, a; } rgba;
-	unsigned int v;
-} SLO_rgba_t;
+/* The longest run that fits in a SLO_OP_RUN chunk */
+#define SLO_RUN_MAX(index_size) ((index_size) == 64 ? 62 : 58)
+
+/* Quantize v by dropping s bits after adding r, clamped to 255 >> s. The sum
+only reaches 256 if it has to be clamped, and then v >> s is one too large. */
+#define SLO_QUANT(v, s, r) ((((v) + (r)) >> (s)) - (((v) + (r)) >> 8))
+
+static const unsigned char SLO_bayer[4][4] = {
+	{ 0,  8,  2, 10},
+	{12,  4, 14,  6},
+	{ 3, 11,  1,  9},
+	{15,  7, 13,  5}
+};
+
+/* SLO_encode_parallel picks the strip height so that strips have about this
+many pixels, unless the caller asks for a specific one. */
+#define SLO_STRIP_PIXELS (1 << 20)
+
+/* All sizes are computed as size_t with overflow checks, so the only limit on
+the number of pixels is the available memory. Define SLO_PIXELS_MAX to refuse
+anything larger, e.g. to guard against huge allocations for untrusted files. */
+#ifndef SLO_PIXELS_MAX
+	#define SLO_PIXELS_MAX 0xffffffffffffffffULL
+#endif
+#define SLO_SIZE_MAX ((size_t)-1)
+
+/* The decoder collects this many pixels (still quantized) before it stores them
+to the output in one go. Runs are expanded into this small buffer, which stays
+in L1, and the store kernels below then convert whole batches at a time. */
+#define SLO_DECODE_BATCH 256
+
+/* Offsets the store kernels add to a row of pixels after the shift. Entry i is
+for the pixels at x % 4 == i % 4, so a batch starting at x uses the offsets from
+bias + x % 4 on. */
+#define SLO_BIAS_LEN (SLO_DECODE_BATCH + 3)
 
 static const unsigned char SLO_padding[8] = {0,0,0,0,0,0,0,1};
 
-static void SLO_write_32(unsigned char *bytes, int *p, unsigned int v) {
-	bytes[(*p)++] = (0xff000000 & v) >> 24;
-	bytes[(*p)++] = (0x00ff0000 & v) >> 16;
-	bytes[(*p)++] = (0x0000ff00 & v) >> 8;
-	bytes[(*p)++] = (0x000000ff & v);
-}
 
-static unsigned int SLO_read_32(const unsigned char *bytes, int *p) {
-	unsigned int a = bytes[(*p)++];
-	unsigned int b = bytes[(*p)++];
-	unsigned int c = bytes[(*p)++];
-	unsigned int d = bytes[(*p)++];
-	return a << 24 | b << 16 | c << 8 | d;
-}
+/* -----------------------------------------------------------------------------
+Store kernels
 
-void *SLO_encode(const void *data, const SLO_desc *desc, int *out_len) {
-	int i, max_size, p, run;
-	int px_len, px_end, px_pos, channels;
-	unsigned char *bytes;
-	const unsigned char *pixels;
-	SLO_rgba_t index[64];
-	SLO_rgba_t px, px_prev;
+Each kernel takes n decoded pixels, restores the dropped low bits of r, g, b
+for the given quantization level and writes them to dst with either 3 or 4
+channels. If bias is not NULL, it holds n offsets that are added to the pixels
+after the shift (see SLO_recon_bias); they never overflow a byte. The scalar
+versions are the reference; the SIMD versions must produce the exact same
+bytes.
 
-	if (
-		data == NULL || out_len == NULL || desc == NULL ||
-		desc->width == 0 || desc->height == 0 ||
-		desc->channels < 3 || desc->channels > 4 ||
-		desc->colorspace > 1 ||
-		desc->height >= SLO_PIXELS_MAX / desc->width
-	) {
-		return NULL;
-	}
+The kernels are generic over the level and bias. SLO_STORE_VARIANTS makes a
+copy of a kernel for each level, with and without bias, and SLO_store_kernel
+picks the one for an image, so the loops don't have to branch on them. */
 
-	max_size =
-		desc->width * desc->height * (desc->channels + 1) +
-		SLO_HEADER_SIZE + sizeof(SLO_padding);
+typedef void (*SLO_store_fn)(unsigned char *dst, const SLO_rgba_t *src, int n, int level, const SLO_rgba_t *bias);
 
-	p = 0;
-	bytes = (unsigned char *) SLO_MALLOC(max_size);
-	if (!bytes) {
-		return NULL;
+#define SLO_STORE_VARIANT(attr, kernel, level, b) \
+	attr static void kernel##_##level##b(unsigned char *dst, const SLO_rgba_t *src, int n, int l, const SLO_rgba_t *bias) { \
+		(void)l; \
+		kernel(dst, src, n, level, b ? bias : NULL); \
+	}
+#define SLO_STORE_VARIANTS(attr, kernel) \
+	SLO_STORE_VARIANT(attr, kernel, 0, 0) SLO_STORE_VARIANT(attr, kernel, 0, 1) \
+	SLO_STORE_VARIANT(attr, kernel, 1, 0) SLO_STORE_VARIANT(attr, kernel, 1, 1) \
+	SLO_STORE_VARIANT(attr, kernel, 2, 0) SLO_STORE_VARIANT(attr, kernel, 2, 1) \
+	SLO_STORE_VARIANT(attr, kernel, 3, 0) SLO_STORE_VARIANT(attr, kernel, 3, 1) \
+	static const SLO_store_fn kernel##_variants[2][SLO_LEVELS] = { \
+		{kernel##_00, kernel##_10, kernel##_20, kernel##_30}, \
+		{kernel##_01, kernel##_11, kernel##_21, kernel##_31} \
+	};
+#define SLO_NO_TARGET
+
+SLO_FORCE_INLINE void SLO_store_rgb(unsigned char *dst, const SLO_rgba_t *src, int n, int level, const SLO_rgba_t *bias) {
+	const unsigned char *shift = SLO_shifts[level];
+	int i;
+	for (i = 0; i < n; i++) {
+		dst[0] = src[i].rgba.r << shift[0];
+		dst[1] = src[i].rgba.g << shift[1];
+		dst[2] = src[i].rgba.b << shift[2];
+		if (bias) {
+			dst[0] += bias[i].rgba.r;
+			dst[1] += bias[i].rgba.g;
+			dst[2] += bias[i].rgba.b;
+		}
+		dst += 3;
 	}
+}
 
-	SLO_write_32(bytes, &p, SLO_MAGIC);
-	SLO_write_32(bytes, &p, desc->width);
-	SLO_write_32(bytes, &p, desc->height);
-	bytes[p++] = desc->channels;
-	bytes[p++] = desc->colorspace;
+SLO_FORCE_INLINE void SLO_store_rgba(unsigned char *dst, const SLO_rgba_t *src, int n, int level, const SLO_rgba_t *bias) {
+	const unsigned char *shift = SLO_shifts[level];
+	int i;
+	for (i = 0; i < n; i++) {
+		dst[0] = src[i].rgba.r << shift[0];
+		dst[1] = src[i].rgba.g << shift[1];
+		dst[2] = src[i].rgba.b << shift[2];
+		dst[3] = src[i].rgba.a;
+		if (bias) {
+			dst[0] += bias[i].rgba.r;
+			dst[1] += bias[i].rgba.g;
+			dst[2] += bias[i].rgba.b;
+		}
+		dst += 4;
+	}
+}
 
+SLO_STORE_VARIANTS(SLO_NO_TARGET, SLO_store_rgb)
+SLO_STORE_VARIANTS(SLO_NO_TARGET, SLO_store_rgba)
 
-	pixels = (const unsigned char *)data;
+#define SLO_BIAS_TAIL(bias, i) ((bias) ? (bias) + (i) : NULL)
 
-	SLO_ZEROARR(index);
+#ifndef SLO_NO_SIMD
+	#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+		#define SLO_SIMD_X86
+	#elif defined(__aarch64__) || defined(_M_ARM64)
+		#define SLO_SIMD_NEON
+	#endif
+#endif
 
-	run = 0;
-	px_prev.rgba.r = 0;
-	px_prev.rgba.g = 0;
-	px_prev.rgba.b = 0;
-	px_prev.rgba.a = 255;
-	px = px_prev;
+#ifdef SLO_SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+	#include <intrin.h>
+	#define SLO_TARGET(T)
+#else
+	#define SLO_TARGET(T) __attribute__((target(T)))
+#endif
 
-	px_len = desc->width * desc->height * desc->channels;
-	px_end = px_len - desc->channels;
-	channels = desc->channels;
+#define SLO_CPU_SSE41 1
+#define SLO_CPU_AVX2  2
 
-	for (px_pos = 0; px_pos < px_len; px_pos += channels) {
-		px.rgba.r = pixels[px_pos + 0]>>1;
-		px.rgba.g = pixels[px_pos + 1]>>1;
-		px.rgba.b = pixels[px_pos + 2]>>1;
+/* The features are detected on first use. The threaded functions call this
+from their worker threads too, so the cached value is read and written
+atomically; threads that race on the first call both store the same value. */
 
-		if (channels == 4) {
-			px.rgba.a = pixels[px_pos + 3];
+static int SLO_cpu_features(void) {
+#ifdef _MSC_VER
+	static volatile long features = -1;
+	int f = (int)features;
+#else
+	static int features = -1;
+	int f = __atomic_load_n(&features, __ATOMIC_RELAXED);
+#endif
+	if (f < 0) {
+		f = 0;
+	#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 1);
+		if (info[2] & (1 << 19)) {
+			f |= SLO_CPU_SSE41;
 		}
-        
-		if (px.v == px_prev.v ) {
-			run++;
-			if (run == 62 || px_pos == px_end+1) {
-				bytes[p++] = SLO_OP_RUN | (run - 1);
-				run = 0;
+		/* AVX2 also needs the OS to save the ymm registers (OSXSAVE + XCR0) */
+		if ((info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6) {
+			__cpuidex(info, 7, 0);
+			if (info[1] & (1 << 5)) {
+				f |= SLO_CPU_AVX2;
 			}
 		}
-		else {
-			int index_pos;
-
-			if (run > 1) {
-				bytes[p++] = SLO_OP_RUN | (run - 1);
-				run = 0;
-			}
+	#else
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("sse4.1")) {
+			f |= SLO_CPU_SSE41;
+		}
+		if (__builtin_cpu_supports("avx2")) {
+			f |= SLO_CPU_AVX2;
+		}
+	#endif
+	#ifdef _MSC_VER
+		_InterlockedExchange(&features, f);
+	#else
+		__atomic_store_n(&features, f, __ATOMIC_RELAXED);
+	#endif
+	}
+	return f;
+}
 
-			index_pos = SLO_COLOR_HASH(px) % 64;
+/* Adding a byte to itself is the same as shifting it left by one. A channel
+with a shift of s is doubled in the first s of the (at most 3) steps; the mask
+for a step selects the bytes of those channels. x86 is little endian, so r is
+the lowest byte of a pixel. */
+
+static unsigned int SLO_step_mask(int level, int step) {
+	const unsigned char *shift = SLO_shifts[level];
+	return
+		(shift[0] > step ? 0x000000ff : 0) |
+		(shift[1] > step ? 0x0000ff00 : 0) |
+		(shift[2] > step ? 0x00ff0000 : 0);
+}
 
-			if (index[index_pos].v == px.v || index[index_pos].rgba.a == px.rgba.a * 2 || index[index_pos].rgba.a == px_prev.rgba.a * 8)  {
-					bytes[p++] = SLO_OP_INDEX | index_pos;
-			}
-			else {
-				index[index_pos] = px;
-				
-				if (px.rgba.a == px_prev.rgba.a) {
-					signed char vr = px.rgba.r - px_prev.rgba.r;
-					signed char vg = px.rgba.g - px_prev.rgba.g;
-					signed char vb = px.rgba.b - px_prev.rgba.b;
+/* Steps for the pixels in v, for the masks m0..m2 of the level */
+#define SLO_STEPS(level, add_8, and_8, v, m0, m1, m2) \
+	switch (SLO_shifts[level][0]) { \
+		case 3: v = add_8(v, and_8(v, m2)); /* fall through */ \
+		case 2: v = add_8(v, and_8(v, m1)); /* fall through */ \
+		case 1: v = add_8(v, and_8(v, m0)); /* fall through */ \
+		default: break; \
+	}
 
-					signed char vg_r = vr - vg;
-					signed char vg_b = vb - vg;
+SLO_TARGET("sse4.1")
+SLO_FORCE_INLINE void SLO_store_rgba_sse41(unsigned char *dst, const SLO_rgba_t *src, int n, int level, const SLO_rgba_t *bias) {
+	const __m128i m0 = _mm_set1_epi32((int)SLO_step_mask(level, 0));
+	const __m128i m1 = _mm_set1_epi32((int)SLO_step_mask(level, 1));
+	const __m128i m2 = _mm_set1_epi32((int)SLO_step_mask(level, 2));
+	int i;
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		SLO_STEPS(level, _mm_add_epi8, _mm_and_si128, v, m0, m1, m2)
+		if (bias) {
+			v = _mm_add_epi8(v, _mm_loadu_si128((const __m128i *)(bias + i)));
+		}
+		_mm_storeu_si128((__m128i *)(dst + i * 4), v);
+	}
+	SLO_store_rgba(dst + i * 4, src + i, n - i, level, SLO_BIAS_TAIL(bias, i));
+}
 
-					if (
-						vr > -3 && vr < 2 && 
-						vg > -3 && vg < 2 &&						
-						vb > -3 && vb < 2
-					) {
-						bytes[p++] = SLO_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
-					}
-					else if (
-						vg_r >  -9 && vg_r <  8 &&
-						vg   > -33 && vg   < 32 &&
-						vg_b >  -9 && vg_b <  8
-					) {
-						bytes[p++] = SLO_OP_LUMA     | (vg   + 32);
-						bytes[p++] = (vg_r + 8) << 4 | (vg_b +  8);
-					}
-					else {
-						bytes[p++] = SLO_OP_RGB;
-						bytes[p++] = px.rgba.r;
-						bytes[p++] = px.rgba.g;
-						bytes[p++] = px.rgba.b;
-					}
-				}
-				else {
-					bytes[p++] = SLO_OP_RGBA;
-					bytes[p++] = px.rgba.r;
-					bytes[p++] = px.rgba.g;
-					bytes[p++] = px.rgba.b;
-					bytes[p++] = px.rgba.a;
-				}
-			}
+/* The 3 channel kernels store 16 bytes for every 12 bytes of output. The extra
+4 bytes are overwritten by the next store, so the vector loop has to stop while
+there are still at least 2 pixels left for the scalar tail. */
+
+/* The masks of the 3 channel kernels are packed with the same shuffle as the
+pixels */
+
+SLO_TARGET("sse4.1")
+SLO_FORCE_INLINE void SLO_store_rgb_sse41(unsigned char *dst, const SLO_rgba_t *src, int n, int level, const SLO_rgba_t *bias) {
+	const __m128i pack = _mm_setr_epi8(0,1,2, 4,5,6, 8,9,10, 12,13,14, -1,-1,-1,-1);
+	const __m128i m0 = _mm_shuffle_epi8(_mm_set1_epi32((int)SLO_step_mask(level, 0)), pack);
+	const __m128i m1 = _mm_shuffle_epi8(_mm_set1_epi32((int)SLO_step_mask(level, 1)), pack);
+	const __m128i m2 = _mm_shuffle_epi8(_mm_set1_epi32((int)SLO_step_mask(level, 2)), pack);
+	int i;
+	for (i = 0; i + 6 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		v = _mm_shuffle_epi8(v, pack);
+		SLO_STEPS(level, _mm_add_epi8, _mm_and_si128, v, m0, m1, m2)
+		if (bias) {
+			__m128i b = _mm_loadu_si128((const __m128i *)(bias + i));
+			v = _mm_add_epi8(v, _mm_shuffle_epi8(b, pack));
 		}
-		px_prev = px;
+		_mm_storeu_si128((__m128i *)(dst + i * 3), v);
 	}
+	SLO_store_rgb(dst + i * 3, src + i, n - i, level, SLO_BIAS_TAIL(bias, i));
+}
 
-	for (i = 0; i < (int)sizeof(SLO_padding); i++) {
-		bytes[p++] = SLO_padding[i];
+SLO_TARGET("avx2")
+SLO_FORCE_INLINE void SLO_store_rgba_avx2(unsigned char *dst, const SLO_rgba_t *src, int n, int level, const SLO_rgba_t *bias) {
+	const __m256i m0 = _mm256_set1_epi32((int)SLO_step_mask(level, 0));
+	const __m256i m1 = _mm256_set1_epi32((int)SLO_step_mask(level, 1));
+	const __m256i m2 = _mm256_set1_epi32((int)SLO_step_mask(level, 2));
+	int i;
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+		SLO_STEPS(level, _mm256_add_epi8, _mm256_and_si256, v, m0, m1, m2)
+		if (bias) {
+			v = _mm256_add_epi8(v, _mm256_loadu_si256((const __m256i *)(bias + i)));
+		}
+		_mm256_storeu_si256((__m256i *)(dst + i * 4), v);
 	}
+	SLO_store_rgba(dst + i * 4, src + i, n - i, level, SLO_BIAS_TAIL(bias, i));
+}
 
-	*out_len = p;
-	return bytes;
+SLO_TARGET("avx2")
+SLO_FORCE_INLINE void SLO_store_rgb_avx2(unsigned char *dst, const SLO_rgba_t *src, int n, int level, const SLO_rgba_t *bias) {
+	const __m256i pack = _mm256_setr_epi8(
+		0,1,2, 4,5,6, 8,9,10, 12,13,14, -1,-1,-1,-1,
+		0,1,2, 4,5,6, 8,9,10, 12,13,14, -1,-1,-1,-1
+	);
+	const __m256i m0 = _mm256_shuffle_epi8(_mm256_set1_epi32((int)SLO_step_mask(level, 0)), pack);
+	const __m256i m1 = _mm256_shuffle_epi8(_mm256_set1_epi32((int)SLO_step_mask(level, 1)), pack);
+	const __m256i m2 = _mm256_shuffle_epi8(_mm256_set1_epi32((int)SLO_step_mask(level, 2)), pack);
+	int i;
+	for (i = 0; i + 10 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+		v = _mm256_shuffle_epi8(v, pack);
+		SLO_STEPS(level, _mm256_add_epi8, _mm256_and_si256, v, m0, m1, m2)
+		if (bias) {
+			__m256i b = _mm256_loadu_si256((const __m256i *)(bias + i));
+			v = _mm256_add_epi8(v, _mm256_shuffle_epi8(b, pack));
+		}
+		_mm_storeu_si128((__m128i *)(dst + i * 3), _mm256_castsi256_si128(v));
+		_mm_storeu_si128((__m128i *)(dst + i * 3 + 12), _mm256_extracti128_si256(v, 1));
+	}
+	SLO_store_rgb(dst + i * 3, src + i, n - i, level, SLO_BIAS_TAIL(bias, i));
 }
 
-void *SLO_decode(const void *data, int size, SLO_desc *desc, int channels) {
-	const unsigned char *bytes;
-	unsigned int header_magic;
-	unsigned char *pixels;
-	SLO_rgba_t index[64];
-	SLO_rgba_t px;
-	int px_len, chunks_len, px_pos;
-	int p = 0, run = 0;
+SLO_STORE_VARIANTS(SLO_TARGET("sse4.1"), SLO_store_rgba_sse41)
+SLO_STORE_VARIANTS(SLO_TARGET("sse4.1"), SLO_store_rgb_sse41)
+SLO_STORE_VARIANTS(SLO_TARGET("avx2"), SLO_store_rgba_avx2)
+SLO_STORE_VARIANTS(SLO_TARGET("avx2"), SLO_store_rgb_avx2)
+#endif /* SLO_SIMD_X86 */
+
+#ifdef SLO_SIMD_NEON
+#include <arm_neon.h>
+
+SLO_FORCE_INLINE void SLO_store_rgba_neon(unsigned char *dst, const SLO_rgba_t *src, int n, int level, const SLO_rgba_t *bias) {
+	const int8x16_t sr = vdupq_n_s8(SLO_shifts[level][0]);
+	const int8x16_t sg = vdupq_n_s8(SLO_shifts[level][1]);
+	const int8x16_t sb = vdupq_n_s8(SLO_shifts[level][2]);
+	int i;
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16x4_t v = vld4q_u8((const unsigned char *)(src + i));
+		v.val[0] = vshlq_u8(v.val[0], sr);
+		v.val[1] = vshlq_u8(v.val[1], sg);
+		v.val[2] = vshlq_u8(v.val[2], sb);
+		if (bias) {
+			uint8x16x4_t b = vld4q_u8((const unsigned char *)(bias + i));
+			v.val[0] = vaddq_u8(v.val[0], b.val[0]);
+			v.val[1] = vaddq_u8(v.val[1], b.val[1]);
+			v.val[2] = vaddq_u8(v.val[2], b.val[2]);
+		}
+		vst4q_u8(dst + i * 4, v);
+	}
+	SLO_store_rgba(dst + i * 4, src + i, n - i, level, SLO_BIAS_TAIL(bias, i));
+}
 
-	if (
-		data == NULL || desc == NULL ||
-		(channels != 0 && channels != 3 && channels != 4) ||
-		size < SLO_HEADER_SIZE + (int)sizeof(SLO_padding)
-	) {
-		return NULL;
+SLO_FORCE_INLINE void SLO_store_rgb_neon(unsigned char *dst, const SLO_rgba_t *src, int n, int level, const SLO_rgba_t *bias) {
+	const int8x16_t sr = vdupq_n_s8(SLO_shifts[level][0]);
+	const int8x16_t sg = vdupq_n_s8(SLO_shifts[level][1]);
+	const int8x16_t sb = vdupq_n_s8(SLO_shifts[level][2]);
+	int i;
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16x4_t v = vld4q_u8((const unsigned char *)(src + i));
+		uint8x16x3_t o;
+		o.val[0] = vshlq_u8(v.val[0], sr);
+		o.val[1] = vshlq_u8(v.val[1], sg);
+		o.val[2] = vshlq_u8(v.val[2], sb);
+		if (bias) {
+			uint8x16x4_t b = vld4q_u8((const unsigned char *)(bias + i));
+			o.val[0] = vaddq_u8(o.val[0], b.val[0]);
+			o.val[1] = vaddq_u8(o.val[1], b.val[1]);
+			o.val[2] = vaddq_u8(o.val[2], b.val[2]);
+		}
+		vst3q_u8(dst + i * 3, o);
 	}
+	SLO_store_rgb(dst + i * 3, src + i, n - i, level, SLO_BIAS_TAIL(bias, i));
+}
 
-	bytes = (const unsigned char *)data;
+SLO_STORE_VARIANTS(SLO_NO_TARGET, SLO_store_rgba_neon)
+SLO_STORE_VARIANTS(SLO_NO_TARGET, SLO_store_rgb_neon)
+#endif /* SLO_SIMD_NEON */
 
-	header_magic = SLO_read_32(bytes, &p);
-	desc->width = SLO_read_32(bytes, &p);
-	desc->height = SLO_read_32(bytes, &p);
-	desc->channels = bytes[p++];
-	desc->colorspace = bytes[p++];
+/* Whether the decoder adds offsets to the pixels of the image */
+static int SLO_recon_biased(const SLO_desc *desc) {
+	return desc->recon != SLO_RECON_SHIFT && SLO_shifts[SLO_LEVEL(desc)][0] != 0;
+}
 
-	if (
-		desc->width == 0 || desc->height == 0 ||
-		desc->channels < 3 || desc->channels > 4 ||
-		desc->colorspace > 1 ||
-		header_magic != SLO_MAGIC ||
-		desc->height >= SLO_PIXELS_MAX / desc->width
-	) {
-		return NULL;
+/* The store kernel for the image described by desc, written with the given
+number of channels */
+static SLO_store_fn SLO_store_kernel(const SLO_desc *desc, int channels) {
+	int level = SLO_LEVEL(desc);
+	int b = SLO_recon_biased(desc);
+#if defined(SLO_SIMD_X86)
+	int features = SLO_cpu_features();
+	if (features & SLO_CPU_AVX2) {
+		return channels == 4 ? SLO_store_rgba_avx2_variants[b][level] : SLO_store_rgb_avx2_variants[b][level];
 	}
-
-	if (channels == 0) {
-		channels = desc->channels;
+	if (features & SLO_CPU_SSE41) {
+		return channels == 4 ? SLO_store_rgba_sse41_variants[b][level] : SLO_store_rgb_sse41_variants[b][level];
 	}
+#elif defined(SLO_SIMD_NEON)
+	return channels == 4 ? SLO_store_rgba_neon_variants[b][level] : SLO_store_rgb_neon_variants[b][level];
+#endif
+	return channels == 4 ? SLO_store_rgba_variants[b][level] : SLO_store_rgb_variants[b][level];
+}
 
-	px_len = desc->width * desc->height * channels;
-	pixels = (unsigned char *) SLO_MALLOC(px_len);
-	if (!pixels) {
+/* Fill bias with the offsets for row y of the image. Returns NULL if the
+decoder doesn't add any, so that the store kernels can skip them. */
+static const SLO_rgba_t *SLO_recon_bias(SLO_rgba_t *bias, const SLO_desc *desc, unsigned int y) {
+	const unsigned char *shift = SLO_shifts[SLO_LEVEL(desc)];
+	int i, t;
+
+	if (!SLO_recon_biased(desc)) {
 		return NULL;
 	}
+	for (i = 0; i < SLO_BIAS_LEN; i++) {
+		t = desc->recon == SLO_RECON_DITHER ? SLO_bayer[y & 3][i & 3] * 2 + 1 : 16;
+		bias[i].rgba.r = (t << shift[0]) >> 5;
+		bias[i].rgba.g = (t << shift[1]) >> 5;
+		bias[i].rgba.b = (t << shift[2]) >> 5;
+		bias[i].rgba.a = 0;
+	}
+	return bias;
+}
 
-	SLO_ZEROARR(index);
-	px.rgba.r = 0;
-	px.rgba.g = 0;
-	px.rgba.b = 0;
-	px.rgba.a = 255;
 
-	chunks_len = size - (int)sizeof(SLO_padding);
-	for (px_pos = 0; px_pos < px_len; px_pos += channels) {
+/* -----------------------------------------------------------------------------
+Match kernels
+
+Each kernel returns the number of leading bytes that a and b have in common, at
+most len. The encoder compares the input with itself one pixel further on, so
+the result tells how many of the following pixels are the same as the current
+one. Like the store kernels, the SIMD versions must return the same as the
+scalar one. */
+
+typedef size_t (*SLO_match_fn)(const unsigned char *a, const unsigned char *b, size_t len);
+
+static size_t SLO_match(const unsigned char *a, const unsigned char *b, size_t len) {
+	unsigned long long x, y;
+	size_t i = 0;
+	while (i + 8 <= len) {
+		memcpy(&x, a + i, 8);
+		memcpy(&y, b + i, 8);
+		if (x != y) {
+			break;
+		}
+		i += 8;
+	}
+	while (i < len && a[i] == b[i]) {
+		i++;
+	}
+	return i;
+}
+
+#ifdef SLO_SIMD_X86
+SLO_TARGET("sse4.1")
+static size_t SLO_match_sse41(const unsigned char *a, const unsigned char *b, size_t len) {
+	size_t i;
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xffff) {
+			break;
+		}
+	}
+	return i + SLO_match(a + i, b + i, len - i);
+}
+
+SLO_TARGET("avx2")
+static size_t SLO_match_avx2(const unsigned char *a, const unsigned char *b, size_t len) {
+	size_t i;
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) != -1) {
+			break;
+		}
+	}
+	return i + SLO_match(a + i, b + i, len - i);
+}
+#endif /* SLO_SIMD_X86 */
+
+#ifdef SLO_SIMD_NEON
+static size_t SLO_match_neon(const unsigned char *a, const unsigned char *b, size_t len) {
+	size_t i;
+	for (i = 0; i + 16 <= len; i += 16) {
+		if (vminvq_u8(vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i))) != 0xff) {
+			break;
+		}
+	}
+	return i + SLO_match(a + i, b + i, len - i);
+}
+#endif /* SLO_SIMD_NEON */
+
+static SLO_match_fn SLO_match_kernel(void) {
+#if defined(SLO_SIMD_X86)
+	int features = SLO_cpu_features();
+	if (features & SLO_CPU_AVX2) {
+		return SLO_match_avx2;
+	}
+	if (features & SLO_CPU_SSE41) {
+		return SLO_match_sse41;
+	}
+#elif defined(SLO_SIMD_NEON)
+	return SLO_match_neon;
+#endif
+	return SLO_match;
+}
+
+/* The number of pixels from pixels[pos] on that are the same as it, at least 1.
+Pixels with the same bytes in the input are the same after quantization too,
+which lets the encoders skip over flat areas without looking at each pixel.
+In noisy images most pixels that quantize like the previous one differ from
+the next ones in the input, so match is only called once the next two pixels
+are the same as this one; otherwise the caller goes on pixel by pixel. */
+SLO_FORCE_INLINE size_t SLO_same_pixels(SLO_match_fn match, const unsigned char *pixels, size_t pos, size_t len, int channels) {
+	const unsigned char *a = pixels + pos;
+	size_t three = 3 * (size_t)channels;
+	if (len - pos < three || memcmp(a, a + channels, 2 * channels) != 0) {
+		return 1;
+	}
+	return 3 + match(a + 2 * channels, a + three, len - pos - three) / channels;
+}
+
+static void SLO_write_32(unsigned char *bytes, size_t *p, unsigned int v) {
+	bytes[(*p)++] = (0xff000000 & v) >> 24;
+	bytes[(*p)++] = (0x00ff0000 & v) >> 16;
+	bytes[(*p)++] = (0x0000ff00 & v) >> 8;
+	bytes[(*p)++] = (0x000000ff & v);
+}
+
+static unsigned int SLO_read_32(const unsigned char *bytes, size_t *p) {
+	unsigned int a = bytes[(*p)++];
+	unsigned int b = bytes[(*p)++];
+	unsigned int c = bytes[(*p)++];
+	unsigned int d = bytes[(*p)++];
+	return a << 24 | b << 16 | c << 8 | d;
+}
+
+static void SLO_write_64(unsigned char *bytes, size_t *p, unsigned long long v) {
+	SLO_write_32(bytes, p, (unsigned int)(v >> 32));
+	SLO_write_32(bytes, p, (unsigned int)(v & 0xffffffff));
+}
+
+static unsigned long long SLO_read_64(const unsigned char *bytes, size_t *p) {
+	unsigned long long hi = SLO_read_32(bytes, p);
+	unsigned long long lo = SLO_read_32(bytes, p);
+	return hi << 32 | lo;
+}
+
+static int SLO_strip_count(const SLO_desc *desc) {
+	if (desc->strip_height == 0) {
+		return 0;
+	}
+	return (desc->height - 1) / desc->strip_height + 1;
+}
+
+/* The extension block is only written if it holds anything but the defaults */
+static int SLO_has_ext(const SLO_desc *desc) {
+	return
+		desc->strip_height != 0 || SLO_LEVEL(desc) != 1 ||
+		desc->recon != SLO_RECON_SHIFT || SLO_INDEX_SIZE(desc) != 64;
+}
+
+/* Size of the header including the extension block and the strip table */
+static size_t SLO_header_size(const SLO_desc *desc) {
+	int strips = SLO_strip_count(desc);
+	if (!SLO_has_ext(desc)) {
+		return SLO_HEADER_SIZE;
+	}
+	return SLO_HEADER_SIZE + 1 + SLO_EXT_SIZE + (size_t)strips * 8;
+}
+
+/* Size of width * height elements of the given size, or 0 if that doesn't fit
+into a size_t */
+static size_t SLO_image_size(const SLO_desc *desc, size_t size) {
+	size_t px_count;
+	if (desc->width > SLO_SIZE_MAX / desc->height) {
+		return 0;
+	}
+	px_count = (size_t)desc->width * desc->height;
+	if (px_count > SLO_SIZE_MAX / size) {
+		return 0;
+	}
+	return px_count * size;
+}
+
+
+/* -----------------------------------------------------------------------------
+Allocators
+
+All memory goes through SLO_alloc and SLO_release, which fall back to
+SLO_MALLOC and SLO_FREE without an allocator. Arena and pool blocks are
+aligned to SLO_ALIGN bytes, enough for any type the library allocates. */
+
+#define SLO_ALIGN 16
+
+static void *SLO_alloc(const SLO_allocator *allocator, size_t size) {
+	if (allocator) {
+		return allocator->alloc(allocator->user, size);
+	}
+	return SLO_MALLOC(size);
+}
+
+static void SLO_release(const SLO_allocator *allocator, void *ptr) {
+	if (ptr == NULL) {
+		return;
+	}
+	if (allocator) {
+		allocator->free(allocator->user, ptr);
+	}
+	else {
+		SLO_FREE(ptr);
+	}
+}
+
+/* Bytes to skip from ptr to the next aligned address */
+static size_t SLO_align_pad(const void *ptr) {
+	return (SLO_ALIGN - (size_t)ptr % SLO_ALIGN) % SLO_ALIGN;
+}
+
+void SLO_arena_init(SLO_arena *arena, void *buffer, size_t capacity) {
+	arena->base = (unsigned char *)buffer;
+	arena->capacity = buffer ? capacity : 0;
+	arena->used = 0;
+}
+
+void SLO_arena_reset(SLO_arena *arena) {
+	arena->used = 0;
+}
+
+static void *SLO_arena_alloc(void *user, size_t size) {
+	SLO_arena *arena = (SLO_arena *)user;
+	size_t pad = SLO_align_pad(arena->base + arena->used);
+	void *ptr;
+
+	if (pad > arena->capacity - arena->used || size > arena->capacity - arena->used - pad) {
+		return NULL;
+	}
+	ptr = arena->base + arena->used + pad;
+	arena->used += pad + size;
+	return ptr;
+}
+
+static void SLO_arena_free(void *user, void *ptr) {
+	(void)user;
+	(void)ptr;
+}
+
+SLO_allocator SLO_arena_allocator(SLO_arena *arena) {
+	SLO_allocator allocator;
+	allocator.alloc = SLO_arena_alloc;
+	allocator.free = SLO_arena_free;
+	allocator.user = arena;
+	return allocator;
+}
+
+/* Free blocks are linked through their first bytes */
+
+void SLO_pool_init(SLO_pool *pool, void *buffer, size_t capacity, size_t block_size) {
+	unsigned char *block = (unsigned char *)buffer;
+	size_t pad = buffer ? SLO_align_pad(buffer) : 0;
+	size_t count = 0;
+	void *next;
+
+	block_size = (block_size + SLO_ALIGN - 1) / SLO_ALIGN * SLO_ALIGN;
+	if (block_size == 0) {
+		block_size = SLO_ALIGN;
+	}
+	if (buffer && capacity > pad) {
+		count = (capacity - pad) / block_size;
+	}
+
+	pool->block_size = block_size;
+	pool->free_list = NULL;
+	for (block += pad + count * block_size; count > 0; count--) {
+		block -= block_size;
+		next = pool->free_list;
+		memcpy(block, &next, sizeof(void *));
+		pool->free_list = block;
+	}
+}
+
+static void *SLO_pool_alloc(void *user, size_t size) {
+	SLO_pool *pool = (SLO_pool *)user;
+	void *block = pool->free_list;
+
+	if (block == NULL || size > pool->block_size) {
+		return NULL;
+	}
+	memcpy(&pool->free_list, block, sizeof(void *));
+	return block;
+}
+
+static void SLO_pool_free(void *user, void *ptr) {
+	SLO_pool *pool = (SLO_pool *)user;
+	memcpy(ptr, &pool->free_list, sizeof(void *));
+	pool->free_list = ptr;
+}
+
+SLO_allocator SLO_pool_allocator(SLO_pool *pool) {
+	SLO_allocator allocator;
+	allocator.alloc = SLO_pool_alloc;
+	allocator.free = SLO_pool_free;
+	allocator.user = pool;
+	return allocator;
+}
+
+
+/* -----------------------------------------------------------------------------
+Threads
+
+SLO_parallel_for calls fn(ctx, i) for every i in 0..count-1 on up to the given
+number of threads (0 = one per CPU). The calling thread does its share of the
+work. Items are handed out one at a time, so uneven items still balance.
+
+SLO_parallel_for_threads is the same, but also passes fn the number of the
+thread that runs the item, 0..SLO_thread_count(count, threads)-1. Items on the
+same thread run one after the other, so memory for each thread can be taken
+from the caller's allocator before the threads start and indexed by it.
+
+This is not a shared pool: every call creates its threads and joins them again
+before it returns, so each call pays for starting them. */
+
+typedef void (*SLO_job_fn)(void *ctx, int item);
+typedef void (*SLO_thread_job_fn)(void *ctx, int thread, int item);
+
+typedef struct {
+	SLO_job_fn fn;
+	SLO_thread_job_fn thread_fn;
+	void *ctx;
+	int count;
+	volatile long next;
+} SLO_jobs_t;
+
+static void SLO_run_job(const SLO_jobs_t *jobs, int thread, int item) {
+	if (jobs->thread_fn) {
+		jobs->thread_fn(jobs->ctx, thread, item);
+	}
+	else {
+		jobs->fn(jobs->ctx, item);
+	}
+}
+
+#ifdef SLO_NO_THREADS
+
+static int SLO_thread_count(int count, int threads) {
+	(void)count;
+	(void)threads;
+	return 1;
+}
+
+static void SLO_run_all(int count, int threads, SLO_jobs_t *jobs) {
+	int i;
+	(void)threads;
+	for (i = 0; i < count; i++) {
+		SLO_run_job(jobs, 0, i);
+	}
+}
+
+#else
+
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <pthread.h>
+	#include <unistd.h>
+#endif
+
+#define SLO_THREADS_MAX 64
+
+static int SLO_cpu_count(void) {
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+#endif
+}
+
+/* The number of threads, including the calling one, that are used for count
+items: at least 1 */
+static int SLO_thread_count(int count, int threads) {
+	if (threads <= 0) {
+		threads = SLO_cpu_count();
+	}
+	if (threads > count) {
+		threads = count;
+	}
+	if (threads > SLO_THREADS_MAX) {
+		threads = SLO_THREADS_MAX;
+	}
+	return threads > 1 ? threads : 1;
+}
+
+typedef struct {
+	SLO_jobs_t *jobs;
+	int thread;
+} SLO_worker_t;
+
+static void SLO_run_jobs(SLO_jobs_t *jobs, int thread) {
+	for (;;) {
+	#ifdef _WIN32
+		int i = (int)InterlockedIncrement(&jobs->next) - 1;
+	#else
+		int i = (int)__sync_fetch_and_add(&jobs->next, 1);
+	#endif
+		if (i >= jobs->count) {
+			break;
+		}
+		SLO_run_job(jobs, thread, i);
+	}
+}
+
+#ifdef _WIN32
+static DWORD WINAPI SLO_worker(LPVOID arg) {
+	SLO_worker_t *worker = (SLO_worker_t *)arg;
+	SLO_run_jobs(worker->jobs, worker->thread);
+	return 0;
+}
+#else
+static void *SLO_worker(void *arg) {
+	SLO_worker_t *worker = (SLO_worker_t *)arg;
+	SLO_run_jobs(worker->jobs, worker->thread);
+	return NULL;
+}
+#endif
+
+static void SLO_run_all(int count, int threads, SLO_jobs_t *jobs) {
+#ifdef _WIN32
+	HANDLE workers[SLO_THREADS_MAX];
+#else
+	pthread_t workers[SLO_THREADS_MAX];
+#endif
+	SLO_worker_t args[SLO_THREADS_MAX];
+	int i, started = 0;
+
+	threads = SLO_thread_count(count, threads);
+	jobs->count = count;
+	jobs->next = 0;
+
+	/* If a thread can't be created the remaining ones (at least the calling
+	thread) simply pick up its share. The calling thread is thread 0. */
+	for (i = 1; i < threads; i++) {
+		args[started].jobs = jobs;
+		args[started].thread = started + 1;
+	#ifdef _WIN32
+		workers[started] = CreateThread(NULL, 0, SLO_worker, &args[started], 0, NULL);
+		if (workers[started] == NULL) {
+			break;
+		}
+	#else
+		if (pthread_create(&workers[started], NULL, SLO_worker, &args[started]) != 0) {
+			break;
+		}
+	#endif
+		started++;
+	}
+
+	SLO_run_jobs(jobs, 0);
+
+	for (i = 0; i < started; i++) {
+	#ifdef _WIN32
+		WaitForSingleObject(workers[i], INFINITE);
+		CloseHandle(workers[i]);
+	#else
+		pthread_join(workers[i], NULL);
+	#endif
+	}
+}
+
+#endif /* SLO_NO_THREADS */
+
+static void SLO_parallel_for(int count, int threads, SLO_job_fn fn, void *ctx) {
+	SLO_jobs_t jobs;
+	jobs.fn = fn;
+	jobs.thread_fn = NULL;
+	jobs.ctx = ctx;
+	SLO_run_all(count, threads, &jobs);
+}
+
+static void SLO_parallel_for_threads(int count, int threads, SLO_thread_job_fn fn, void *ctx) {
+	SLO_jobs_t jobs;
+	jobs.fn = NULL;
+	jobs.thread_fn = fn;
+	jobs.ctx = ctx;
+	SLO_run_all(count, threads, &jobs);
+}
+
+
+/* -----------------------------------------------------------------------------
+Encoder */
+
+/* Reset the state to what the en-/decoder starts with at the beginning of an
+image or strip */
+
+static void SLO_state_init(SLO_state *state, int index_size) {
+	SLO_ZEROARR(state->index);
+	state->long_mask = index_size > 64 ? index_size - 1 : 0;
+	memset(state->index_long, 0, (state->long_mask + 1) * sizeof(SLO_rgba_t));
+	state->px.rgba.r = 0;
+	state->px.rgba.g = 0;
+	state->px.rgba.b = 0;
+	state->px.rgba.a = 255;
+	state->run = 0;
+}
+
+/* The value added to r, g, b before they are quantized. Without an offset in
+the decoder, rounding gives the nearest value. With one, the nearest value is
+always that of the cut off bits. Level 1 always cuts them off, like the
+original encoder did. */
+
+static void SLO_quant_round(const SLO_desc *desc, unsigned char *round) {
+	int level = SLO_LEVEL(desc);
+	int k;
+	for (k = 0; k < 3; k++) {
+		round[k] = 0;
+		if (desc->recon == SLO_RECON_SHIFT && level != 1 && SLO_shifts[level][k] > 0) {
+			round[k] = 1 << (SLO_shifts[level][k] - 1);
+		}
+	}
+}
+
+static int SLO_clamp(int v, int lo, int hi) {
+	return v < lo ? lo : v > hi ? hi : v;
+}
+
+static int SLO_abs(int v) {
+	return v < 0 ? -v : v;
+}
+
+/* The range of quantized values the near match encoder accepts for an input
+value of v, per channel (r, g, b, a): lo[k][v] to hi[k][v]. Returns 0 if any of
+the ranges is empty, i.e. if the bound of a bounded desc can't be met. */
+
+static int SLO_near_ranges(const SLO_desc *desc, unsigned char lo[4][256], unsigned char hi[4][256]) {
+	const unsigned char *shift = SLO_shifts[SLO_LEVEL(desc)];
+	unsigned char round[3];
+	int k, v, s, t, q, max, bmin, bmax, err, l, h;
+
+	SLO_quant_round(desc, round);
+	for (k = 0; k < 4; k++) {
+		s = k < 3 ? shift[k] : 0;
+		max = 255 >> s;
+		err = desc->bounded ? desc->max_abs_error[k] : 0;
+
+		/* The offsets the decoder may add after the shift */
+		bmin = bmax = 0;
+		if (k < 3 && desc->recon == SLO_RECON_MIDPOINT) {
+			bmin = bmax = (16 << s) >> 5;
+		}
+		else if (k < 3 && desc->recon == SLO_RECON_DITHER) {
+			bmin = (1 << s) >> 5;
+			bmax = (31 << s) >> 5;
+		}
+
+		for (v = 0; v < 256; v++) {
+			if (k == 3 || desc->bounded) {
+				/* (q << s) + bmin >= v - err and (q << s) + bmax <= v + err */
+				t = v - err - bmin;
+				l = t <= 0 ? 0 : (t + (1 << s) - 1) >> s;
+				t = v + err - bmax;
+				h = t < 0 ? -1 : t >> s;
+			}
+			else {
+				t = desc->tolerance >> s;
+				q = SLO_QUANT(v, s, round[k]);
+				l = q - t;
+				h = q + t;
+			}
+			l = l < 0 ? 0 : l;
+			h = h > max ? max : h;
+			if (l > h) {
+				return 0;
+			}
+			lo[k][v] = l;
+			hi[k][v] = h;
+		}
+	}
+	return 1;
+}
+
+static int SLO_in_range(SLO_rgba_t c, SLO_rgba_t lo, SLO_rgba_t hi) {
+	return
+		c.rgba.r >= lo.rgba.r && c.rgba.r <= hi.rgba.r &&
+		c.rgba.g >= lo.rgba.g && c.rgba.g <= hi.rgba.g &&
+		c.rgba.b >= lo.rgba.b && c.rgba.b <= hi.rgba.b &&
+		c.rgba.a >= lo.rgba.a && c.rgba.a <= hi.rgba.a;
+}
+
+static int SLO_distance(SLO_rgba_t a, SLO_rgba_t b) {
+	return
+		SLO_abs(a.rgba.r - b.rgba.r) + SLO_abs(a.rgba.g - b.rgba.g) +
+		SLO_abs(a.rgba.b - b.rgba.b) + SLO_abs(a.rgba.a - b.rgba.a);
+}
+
+/* Put c into both indexes, like the decoder does after each chunk */
+static void SLO_index_put(SLO_state *state, SLO_rgba_t c) {
+	unsigned int hash = SLO_COLOR_HASH(c);
+	state->index[hash % 64] = c;
+	state->index_long[hash & state->long_mask] = c;
+}
+
+/* Encode chunks like SLO_encode_chunks_exact, but accept near matches (see
+desc->tolerance and desc->bounded): any pixel whose channels are in the range
+of accepted values for the input pixel. px is the value that is sent if none
+is close enough. px_prev is always the pixel as the decoder will see it, so the
+errors don't add up from one pixel to the next. */
+
+SLO_FORCE_INLINE size_t SLO_encode_chunks_near(SLO_state *state, unsigned char *bytes, const unsigned char *pixels, size_t px_len, const SLO_desc *desc, const int channels) {
+	size_t p, px_pos;
+	int run, k, i, best, err, best_err, index_pos;
+	int vr, vg, vb, vg_r, vg_b;
+	SLO_rgba_t *index = state->index;
+	SLO_rgba_t px, px_prev, c, lo, hi;
+	const unsigned char *shift = SLO_shifts[SLO_LEVEL(desc)];
+	unsigned char round[3];
+	unsigned char lo_table[4][256], hi_table[4][256];
+	int max[3];
+	SLO_rgba_t *index_long = state->index_long;
+	int long_mask = state->long_mask;
+	int run_max = SLO_RUN_MAX(long_mask ? long_mask + 1 : 64);
+	SLO_match_fn match = SLO_match_kernel();
+	unsigned int hash;
+	size_t n;
+
+	SLO_quant_round(desc, round);
+	SLO_near_ranges(desc, lo_table, hi_table);
+	for (k = 0; k < 3; k++) {
+		max[k] = 255 >> shift[k];
+	}
+
+	p = 0;
+	run = state->run;
+	px_prev = state->px;
+	px = px_prev;
+	lo.rgba.a = hi.rgba.a = 255;
+
+	for (px_pos = 0; px_pos < px_len; px_pos += channels) {
+		lo.rgba.r = lo_table[0][pixels[px_pos + 0]];
+		hi.rgba.r = hi_table[0][pixels[px_pos + 0]];
+		lo.rgba.g = lo_table[1][pixels[px_pos + 1]];
+		hi.rgba.g = hi_table[1][pixels[px_pos + 1]];
+		lo.rgba.b = lo_table[2][pixels[px_pos + 2]];
+		hi.rgba.b = hi_table[2][pixels[px_pos + 2]];
+		if (channels == 4) {
+			lo.rgba.a = lo_table[3][pixels[px_pos + 3]];
+			hi.rgba.a = hi_table[3][pixels[px_pos + 3]];
+		}
+		px.rgba.r = SLO_clamp(SLO_QUANT(pixels[px_pos + 0], shift[0], round[0]), lo.rgba.r, hi.rgba.r);
+		px.rgba.g = SLO_clamp(SLO_QUANT(pixels[px_pos + 1], shift[1], round[1]), lo.rgba.g, hi.rgba.g);
+		px.rgba.b = SLO_clamp(SLO_QUANT(pixels[px_pos + 2], shift[2], round[2]), lo.rgba.b, hi.rgba.b);
+
+		if (channels == 4) {
+			px.rgba.a = pixels[px_pos + 3];
+		}
+
+		if (SLO_in_range(px_prev, lo, hi)) {
+			n = SLO_same_pixels(match, pixels, px_pos, px_len, channels);
+			px_pos += (n - 1) * channels;
+			for (n += run; n >= (size_t)run_max; n -= run_max) {
+				bytes[p++] = SLO_OP_RUN | (run_max - 1);
+				SLO_index_put(state, px_prev);
+			}
+			run = (int)n;
+			continue;
+		}
+
+		/* Like the decoder, put the pixel into the index after each chunk.
+		This only matters for the initial pixel of a run and for the
+		all-zero entries of the index, which no chunk has put there. */
+		if (run > 0) {
+			bytes[p++] = SLO_OP_RUN | (run - 1);
+			SLO_index_put(state, px_prev);
+			run = 0;
+		}
+
+		/* The chunks from smallest to largest: the index entry with the
+		hash of px, a diff, any other index entry, a luma diff, the long
+		index entry with the hash of px. Diffs keep the alpha of px_prev. */
+		hash = SLO_COLOR_HASH(px);
+		index_pos = hash % 64;
+		vr = px.rgba.r - px_prev.rgba.r;
+		vg = px.rgba.g - px_prev.rgba.g;
+		vb = px.rgba.b - px_prev.rgba.b;
+
+		if (SLO_in_range(index[index_pos], lo, hi)) {
+			bytes[p++] = SLO_OP_INDEX | index_pos;
+			px_prev = index[index_pos];
+			SLO_index_put(state, px_prev);
+			continue;
+		}
+
+		/* Clamping the differences keeps c between px_prev and px */
+		c = px_prev;
+		c.rgba.r += SLO_clamp(vr, -2, 1);
+		c.rgba.g += SLO_clamp(vg, -2, 1);
+		c.rgba.b += SLO_clamp(vb, -2, 1);
+		if (SLO_in_range(c, lo, hi)) {
+			bytes[p++] = SLO_OP_DIFF |
+				(c.rgba.r - px_prev.rgba.r + 2) << 4 |
+				(c.rgba.g - px_prev.rgba.g + 2) << 2 |
+				(c.rgba.b - px_prev.rgba.b + 2);
+			SLO_index_put(state, c);
+			px_prev = c;
+			continue;
+		}
+
+		best = -1;
+		best_err = 0;
+		for (i = 0; i < 64; i++) {
+			if (SLO_in_range(index[i], lo, hi)) {
+				err = SLO_distance(index[i], px);
+				if (best < 0 || err < best_err) {
+					best = i;
+					best_err = err;
+				}
+			}
+		}
+		if (best >= 0) {
+			bytes[p++] = SLO_OP_INDEX | best;
+			px_prev = index[best];
+			SLO_index_put(state, px_prev);
+			continue;
+		}
+
+		/* Going past the range of a channel would wrap around in the
+		decoder, so those are rejected */
+		vg = SLO_clamp(vg, -32, 31);
+		vg_r = vg + SLO_clamp(vr - vg, -8, 7);
+		vg_b = vg + SLO_clamp(vb - vg, -8, 7);
+		if (
+			px_prev.rgba.r + vg_r >= 0 && px_prev.rgba.r + vg_r <= max[0] &&
+			px_prev.rgba.g + vg   >= 0 && px_prev.rgba.g + vg   <= max[1] &&
+			px_prev.rgba.b + vg_b >= 0 && px_prev.rgba.b + vg_b <= max[2]
+		) {
+			c = px_prev;
+			c.rgba.r += vg_r;
+			c.rgba.g += vg;
+			c.rgba.b += vg_b;
+			if (SLO_in_range(c, lo, hi)) {
+				bytes[p++] = SLO_OP_LUMA | (vg + 32);
+				bytes[p++] = (vg_r - vg + 8) << 4 | (vg_b - vg + 8);
+				SLO_index_put(state, c);
+				px_prev = c;
+				continue;
+			}
+		}
+
+		index_pos = hash & long_mask;
+		if (long_mask && SLO_in_range(index_long[index_pos], lo, hi)) {
+			bytes[p++] = SLO_OP_INDEX_LONG_TAG(index_pos);
+			bytes[p++] = index_pos & 0xff;
+			px_prev = index_long[index_pos];
+			SLO_index_put(state, px_prev);
+			continue;
+		}
+
+		/* An RGB chunk will do if the alpha of px_prev is close enough */
+		if (px_prev.rgba.a >= lo.rgba.a && px_prev.rgba.a <= hi.rgba.a) {
+			px.rgba.a = px_prev.rgba.a;
+			bytes[p++] = SLO_OP_RGB;
+			bytes[p++] = px.rgba.r;
+			bytes[p++] = px.rgba.g;
+			bytes[p++] = px.rgba.b;
+		}
+		else {
+			bytes[p++] = SLO_OP_RGBA;
+			bytes[p++] = px.rgba.r;
+			bytes[p++] = px.rgba.g;
+			bytes[p++] = px.rgba.b;
+			bytes[p++] = px.rgba.a;
+		}
+		SLO_index_put(state, px);
+		px_prev = px;
+	}
+
+	state->px = px_prev;
+	state->run = run;
+	return p;
+}
+
+/* Encode chunks that match the pixels exactly (after quantization), for the
+given channels and level, which must be those of desc */
+
+SLO_FORCE_INLINE size_t SLO_encode_chunks_exact(SLO_state *state, unsigned char *bytes, const unsigned char *pixels, size_t px_len, const SLO_desc *desc, const int channels, const int level) {
+	size_t p, px_pos, n;
+	int run;
+	SLO_rgba_t *index = state->index;
+	SLO_rgba_t *index_long = state->index_long;
+	int long_mask = state->long_mask;
+	SLO_match_fn match = SLO_match_kernel();
+	SLO_rgba_t px, px_prev;
+	const unsigned char *shift = SLO_shifts[level];
+	unsigned char round[3];
+
+	int run_max = SLO_RUN_MAX(SLO_INDEX_SIZE(desc));
+
+	SLO_quant_round(desc, round);
+
+	p = 0;
+	run = state->run;
+	px_prev = state->px;
+	px = px_prev;
+
+	for (px_pos = 0; px_pos < px_len; px_pos += channels) {
+		px.rgba.r = SLO_QUANT(pixels[px_pos + 0], shift[0], round[0]);
+		px.rgba.g = SLO_QUANT(pixels[px_pos + 1], shift[1], round[1]);
+		px.rgba.b = SLO_QUANT(pixels[px_pos + 2], shift[2], round[2]);
+
+		if (channels == 4) {
+			px.rgba.a = pixels[px_pos + 3];
+		}
+        
+		if (px.v == px_prev.v ) {
+			n = SLO_same_pixels(match, pixels, px_pos, px_len, channels);
+			px_pos += (n - 1) * channels;
+			for (n += run; n >= (size_t)run_max; n -= run_max) {
+				bytes[p++] = SLO_OP_RUN | (run_max - 1);
+				index_long[SLO_COLOR_HASH(px) & long_mask] = px;
+			}
+			run = (int)n;
+		}
+		else {
+			unsigned int hash = SLO_COLOR_HASH(px);
+			int index_pos = hash % 64;
+			int long_pos = hash & long_mask;
+			int hit = 0;
+
+			if (run > 0) {
+				bytes[p++] = SLO_OP_RUN | (run - 1);
+				index_long[SLO_COLOR_HASH(px_prev) & long_mask] = px_prev;
+				run = 0;
+			}
+			if (long_mask) {
+				hit = index_long[long_pos].v == px.v;
+				index_long[long_pos] = px;
+			}
+
+			if (index[index_pos].v == px.v) {
+				bytes[p++] = SLO_OP_INDEX | index_pos;
+			}
+			else {
+				/* A long index chunk is 2 bytes, so a diff is still
+				preferred */
+				index[index_pos] = px;
+				
+				if (px.rgba.a == px_prev.rgba.a) {
+					signed char vr = px.rgba.r - px_prev.rgba.r;
+					signed char vg = px.rgba.g - px_prev.rgba.g;
+					signed char vb = px.rgba.b - px_prev.rgba.b;
+
+					signed char vg_r = vr - vg;
+					signed char vg_b = vb - vg;
+
+					if (
+						vr > -3 && vr < 2 && 
+						vg > -3 && vg < 2 &&						
+						vb > -3 && vb < 2
+					) {
+						bytes[p++] = SLO_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+					}
+					else if (hit) {
+						bytes[p++] = SLO_OP_INDEX_LONG_TAG(long_pos);
+						bytes[p++] = long_pos & 0xff;
+					}
+					else if (
+						vg_r >  -9 && vg_r <  8 &&
+						vg   > -33 && vg   < 32 &&
+						vg_b >  -9 && vg_b <  8
+					) {
+						bytes[p++] = SLO_OP_LUMA     | (vg   + 32);
+						bytes[p++] = (vg_r + 8) << 4 | (vg_b +  8);
+					}
+					else {
+						bytes[p++] = SLO_OP_RGB;
+						bytes[p++] = px.rgba.r;
+						bytes[p++] = px.rgba.g;
+						bytes[p++] = px.rgba.b;
+					}
+				}
+				else if (hit) {
+					bytes[p++] = SLO_OP_INDEX_LONG_TAG(long_pos);
+					bytes[p++] = long_pos & 0xff;
+				}
+				else {
+					bytes[p++] = SLO_OP_RGBA;
+					bytes[p++] = px.rgba.r;
+					bytes[p++] = px.rgba.g;
+					bytes[p++] = px.rgba.b;
+					bytes[p++] = px.rgba.a;
+				}
+			}
+		}
+		px_prev = px;
+	}
+
+	state->px = px_prev;
+	state->run = run;
+	return p;
+}
+
+typedef size_t (*SLO_encode_fn)(SLO_state *state, unsigned char *bytes, const unsigned char *pixels, size_t px_len, const SLO_desc *desc);
+
+#define SLO_ENCODE_EXACT(name, channels, level) \
+	static size_t name(SLO_state *state, unsigned char *bytes, const unsigned char *pixels, size_t px_len, const SLO_desc *desc) { \
+		return SLO_encode_chunks_exact(state, bytes, pixels, px_len, desc, channels, level); \
+	}
+#define SLO_ENCODE_NEAR(name, channels) \
+	static size_t name(SLO_state *state, unsigned char *bytes, const unsigned char *pixels, size_t px_len, const SLO_desc *desc) { \
+		return SLO_encode_chunks_near(state, bytes, pixels, px_len, desc, channels); \
+	}
+
+SLO_ENCODE_EXACT(SLO_encode_rgb_0, 3, 0)
+SLO_ENCODE_EXACT(SLO_encode_rgb_1, 3, 1)
+SLO_ENCODE_EXACT(SLO_encode_rgb_2, 3, 2)
+SLO_ENCODE_EXACT(SLO_encode_rgb_3, 3, 3)
+SLO_ENCODE_EXACT(SLO_encode_rgba_0, 4, 0)
+SLO_ENCODE_EXACT(SLO_encode_rgba_1, 4, 1)
+SLO_ENCODE_EXACT(SLO_encode_rgba_2, 4, 2)
+SLO_ENCODE_EXACT(SLO_encode_rgba_3, 4, 3)
+SLO_ENCODE_NEAR(SLO_encode_rgb_near, 3)
+SLO_ENCODE_NEAR(SLO_encode_rgba_near, 4)
+
+static const SLO_encode_fn SLO_encode_kernels[2][SLO_LEVELS] = {
+	{SLO_encode_rgb_0, SLO_encode_rgb_1, SLO_encode_rgb_2, SLO_encode_rgb_3},
+	{SLO_encode_rgba_0, SLO_encode_rgba_1, SLO_encode_rgba_2, SLO_encode_rgba_3}
+};
+
+/* Whether the near kernels have anything to accept. The tolerance is in 8 bit
+units and rounds down to 0 after a shift of the same size or more, and then
+only exact matches are close enough. */
+static int SLO_near(const SLO_desc *desc) {
+	const unsigned char *shift = SLO_shifts[SLO_LEVEL(desc)];
+	int k;
+	if (desc->bounded) {
+		return 1;
+	}
+	for (k = 0; k < 3; k++) {
+		if (desc->tolerance >> shift[k]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Encode px_len bytes of pixels as chunks, continuing from the given state.
+At most px_len / channels * (channels + 1) bytes are written. Returns the
+number of bytes written. */
+
+static size_t SLO_encode_chunks(SLO_state *state, unsigned char *bytes, const unsigned char *pixels, size_t px_len, const SLO_desc *desc) {
+	SLO_encode_fn encode = SLO_encode_kernels[desc->channels - 3][SLO_LEVEL(desc)];
+	if (SLO_near(desc)) {
+		encode = desc->channels == 4 ? SLO_encode_rgba_near : SLO_encode_rgb_near;
+	}
+	return encode(state, bytes, pixels, px_len, desc);
+}
+
+/* Write the run that is still pending at the end of an image or strip, so that
+every pixel is covered by a chunk. Returns the number of bytes written (0 or
+1). */
+
+static size_t SLO_encode_end(SLO_state *state, unsigned char *bytes) {
+	if (state->run == 0) {
+		return 0;
+	}
+	bytes[0] = SLO_OP_RUN | (state->run - 1);
+	state->run = 0;
+	return 1;
+}
+
+/* A bounded desc is only valid if the bound can be met */
+static int SLO_bound_valid(const SLO_desc *desc) {
+	unsigned char lo[4][256], hi[4][256];
+	return !desc->bounded || SLO_near_ranges(desc, lo, hi);
+}
+
+static int SLO_desc_valid(const SLO_desc *desc) {
+	return
+		desc != NULL &&
+		desc->width != 0 && desc->height != 0 &&
+		desc->channels >= 3 && desc->channels <= 4 &&
+		desc->colorspace <= 1 &&
+		desc->quality <= SLO_LEVELS &&
+		desc->recon <= SLO_RECON_DITHER &&
+		(desc->index_size == 0 || desc->index_size == 64 || desc->index_size == 256 || desc->index_size == 1024) &&
+		SLO_bound_valid(desc) &&
+		(unsigned long long)desc->width * desc->height <= SLO_PIXELS_MAX &&
+		(desc->strip_height == 0 || (desc->height - 1) / desc->strip_height < INT_MAX);
+}
+
+/* Write the header and, if needed, the extension block. The strip table is
+left for the caller to fill in. */
+
+static void SLO_write_header(unsigned char *bytes, size_t *p, const SLO_desc *desc) {
+	int ext = SLO_has_ext(desc);
+
+	SLO_write_32(bytes, p, SLO_MAGIC);
+	SLO_write_32(bytes, p, desc->width);
+	SLO_write_32(bytes, p, desc->height);
+	bytes[(*p)++] = desc->channels;
+	bytes[(*p)++] = desc->colorspace | (ext ? SLO_HEADER_EXT : 0);
+
+	if (ext) {
+		bytes[(*p)++] = SLO_EXT_SIZE;
+		SLO_write_32(bytes, p, desc->strip_height);
+		bytes[(*p)++] = SLO_LEVEL(desc);
+		bytes[(*p)++] = desc->recon;
+		bytes[(*p)++] = SLO_INDEX_SIZE(desc) == 1024 ? 10 : SLO_INDEX_SIZE(desc) == 256 ? 8 : 6;
+	}
+}
+
+/* Strips encoded in parallel are written to their worst case position in the
+output first and moved in place once all of them are done. */
+
+typedef struct {
+	unsigned char *bytes;
+	const unsigned char *pixels;
+	const SLO_desc *desc;
+	size_t header_size;
+	size_t *strip_len;
+} SLO_encode_job_t;
+
+static size_t SLO_strip_slot(const SLO_encode_job_t *job, int strip) {
+	const SLO_desc *desc = job->desc;
+	return job->header_size +
+		(size_t)strip * desc->strip_height * desc->width * (desc->channels + 1);
+}
+
+static void SLO_encode_strip(void *ctx, int strip) {
+	SLO_encode_job_t *job = (SLO_encode_job_t *)ctx;
+	const SLO_desc *desc = job->desc;
+	size_t row_len = (size_t)desc->width * desc->channels;
+	unsigned int y = strip * desc->strip_height;
+	unsigned int rows = desc->height - y < desc->strip_height ? desc->height - y : desc->strip_height;
+	unsigned char *bytes;
+	size_t p;
+	SLO_state state;
+
+	SLO_state_init(&state, SLO_INDEX_SIZE(desc));
+	bytes = job->bytes + SLO_strip_slot(job, strip);
+	p = SLO_encode_chunks(&state, bytes, job->pixels + y * row_len, rows * row_len, desc);
+	job->strip_len[strip] = p + SLO_encode_end(&state, bytes + p);
+}
+
+size_t SLO_encode_bound(const SLO_desc *desc) {
+	size_t max_size, header_size;
+
+	if (!SLO_desc_valid(desc)) {
+		return 0;
+	}
+
+	header_size = SLO_header_size(desc);
+	max_size = SLO_image_size(desc, desc->channels + 1);
+	if (max_size == 0 || max_size > SLO_SIZE_MAX - header_size - sizeof(SLO_padding)) {
+		return 0;
+	}
+	return max_size + header_size + sizeof(SLO_padding);
+}
+
+static int SLO_measure_error_impl(const void *data, size_t size, const void *pixels, unsigned char *max_error, const SLO_allocator *allocator);
+
+/* Check the encoded image against the bound of a bounded desc */
+static int SLO_check_bound(const unsigned char *bytes, size_t size, const void *pixels, const SLO_desc *desc, const SLO_allocator *allocator) {
+	unsigned char max_error[4];
+	int k;
+
+	if (!desc->bounded) {
+		return 1;
+	}
+	if (!SLO_measure_error_impl(bytes, size, pixels, max_error, allocator)) {
+		return 0;
+	}
+	for (k = 0; k < desc->channels; k++) {
+		if (max_error[k] > desc->max_abs_error[k]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Encode the image into bytes, which must hold SLO_encode_bound(desc) bytes.
+Returns the encoded size, or 0 on failure. */
+
+static size_t SLO_encode_bytes(const void *data, const SLO_desc *desc, unsigned char *bytes, int threads, const SLO_allocator *allocator) {
+	int i, strips;
+	unsigned int y;
+	size_t p, header_size, row_len;
+	const unsigned char *pixels;
+	SLO_state state;
+
+	strips = SLO_strip_count(desc);
+	header_size = SLO_header_size(desc);
+
+	p = 0;
+	SLO_write_header(bytes, &p, desc);
+
+	pixels = (const unsigned char *)data;
+
+	if (strips == 0) {
+		SLO_state_init(&state, SLO_INDEX_SIZE(desc));
+		p += SLO_encode_chunks(&state, bytes + p, pixels, SLO_image_size(desc, desc->channels), desc);
+		p += SLO_encode_end(&state, bytes + p);
+	}
+	else {
+		p = header_size;
+
+		row_len = (size_t)desc->width * desc->channels;
+		if (threads == 1 || strips == 1) {
+			for (i = 0, y = 0; i < strips; i++, y += desc->strip_height) {
+				unsigned int rows = desc->height - y < desc->strip_height ? desc->height - y : desc->strip_height;
+				size_t entry = header_size - (size_t)(strips - i) * 8;
+				SLO_write_64(bytes, &entry, p);
+				SLO_state_init(&state, SLO_INDEX_SIZE(desc));
+				p += SLO_encode_chunks(&state, bytes + p, pixels + y * row_len, rows * row_len, desc);
+				p += SLO_encode_end(&state, bytes + p);
+			}
+		}
+		else {
+			SLO_encode_job_t job;
+			job.bytes = bytes;
+			job.pixels = pixels;
+			job.desc = desc;
+			job.header_size = header_size;
+			job.strip_len = (size_t *) SLO_alloc(allocator, strips * sizeof(size_t));
+			if (!job.strip_len) {
+				return 0;
+			}
+
+			SLO_parallel_for(strips, threads, SLO_encode_strip, &job);
+
+			for (i = 0; i < strips; i++) {
+				size_t entry = header_size - (size_t)(strips - i) * 8;
+				SLO_write_64(bytes, &entry, p);
+				memmove(bytes + p, bytes + SLO_strip_slot(&job, i), job.strip_len[i]);
+				p += job.strip_len[i];
+			}
+			SLO_release(allocator, job.strip_len);
+		}
+	}
+
+	for (i = 0; i < (int)sizeof(SLO_padding); i++) {
+		bytes[p++] = SLO_padding[i];
+	}
+
+	if (!SLO_check_bound(bytes, p, data, desc, allocator)) {
+		return 0;
+	}
+	return p;
+}
+
+static void *SLO_encode_impl(const void *data, const SLO_desc *desc, size_t *out_len, int threads, const SLO_allocator *allocator) {
+	size_t max_size;
+	unsigned char *bytes;
+
+	if (data == NULL || out_len == NULL) {
+		return NULL;
+	}
+
+	max_size = SLO_encode_bound(desc);
+	if (max_size == 0) {
+		return NULL;
+	}
+
+	bytes = (unsigned char *) SLO_alloc(allocator, max_size);
+	if (!bytes) {
+		return NULL;
+	}
+
+	*out_len = SLO_encode_bytes(data, desc, bytes, threads, allocator);
+	if (*out_len == 0) {
+		SLO_release(allocator, bytes);
+		return NULL;
+	}
+	return bytes;
+}
+
+void *SLO_encode(const void *data, const SLO_desc *desc, int *out_len) {
+	size_t len;
+	void *encoded;
+
+	if (out_len == NULL) {
+		return NULL;
+	}
+
+	encoded = SLO_encode_impl(data, desc, &len, 1, NULL);
+	if (!encoded) {
+		return NULL;
+	}
+	if (len > INT_MAX) {
+		SLO_FREE(encoded);
+		return NULL;
+	}
+	*out_len = (int)len;
+	return encoded;
+}
+
+void *SLO_encode64(const void *data, const SLO_desc *desc, size_t *out_len) {
+	return SLO_encode_impl(data, desc, out_len, 1, NULL);
+}
+
+void *SLO_encode_ex(
+	const void *data, const SLO_desc *desc, size_t *out_len, int threads,
+	const SLO_allocator *allocator
+) {
+	return SLO_encode_impl(data, desc, out_len, threads, allocator);
+}
+
+void *SLO_encode_parallel(const void *data, const SLO_desc *desc, size_t *out_len, int threads) {
+	SLO_desc striped;
+
+	if (desc == NULL || desc->width == 0) {
+		return NULL;
+	}
+
+	striped = *desc;
+	if (striped.strip_height == 0) {
+		striped.strip_height = (SLO_STRIP_PIXELS - 1) / desc->width + 1;
+	}
+	return SLO_encode_impl(data, &striped, out_len, threads, NULL);
+}
+
+/* The images of a batch are split into runs of consecutive images, a few for
+each thread, with about the same worst case size. Each run has a slot of the
+summed worst case sizes of its images in the output, and its thread encodes
+them one after the other, each right behind the previous one. Afterwards the
+runs are moved together. With a single thread there is only one run, which
+needs no moving at all. */
+
+#define SLO_BATCH_RUNS_PER_THREAD 4
+#define SLO_BATCH_RUNS_MAX (SLO_BATCH_RUNS_PER_THREAD * 64)
+
+typedef struct {
+	const SLO_encode_item *items;
+	unsigned char *out;
+	size_t *offsets;
+	int first[SLO_BATCH_RUNS_MAX + 1];  /* the images of run r are first[r] up to first[r + 1] */
+	size_t start[SLO_BATCH_RUNS_MAX];   /* the slot of run r begins at start[r] */
+	size_t end[SLO_BATCH_RUNS_MAX];     /* and its output ends at end[r] */
+} SLO_encode_batch_t;
+
+/* Items without pixels are left empty, whatever their desc holds */
+static size_t SLO_encode_batch_bound(const SLO_encode_item *item) {
+	return item->pixels != NULL ? SLO_encode_bound(&item->desc) : 0;
+}
+
+static void SLO_encode_batch_run(void *ctx, int r) {
+	SLO_encode_batch_t *batch = (SLO_encode_batch_t *)ctx;
+	const SLO_encode_item *item;
+	size_t p = batch->start[r];
+	int i;
+
+	for (i = batch->first[r]; i < batch->first[r + 1]; i++) {
+		item = &batch->items[i];
+		batch->offsets[i] = p;
+		if (SLO_encode_batch_bound(item) > 0) {
+			p += SLO_encode_bytes(item->pixels, &item->desc, batch->out + p, 1, NULL);
+		}
+	}
+	batch->end[r] = p;
+}
+
+void *SLO_encode_batch(
+	const SLO_encode_item *items, int count, size_t *offsets, int threads,
+	const SLO_allocator *allocator
+) {
+	SLO_encode_batch_t batch;
+	size_t total = 0, slot = 0, bound, shift, p;
+	int i, r, runs;
+
+	if (items == NULL || offsets == NULL || count < 0) {
+		return NULL;
+	}
+
+	for (i = 0; i < count; i++) {
+		bound = SLO_encode_batch_bound(&items[i]);
+		if (bound > SLO_SIZE_MAX - total) {
+			return NULL;
+		}
+		total += bound;
+	}
+
+	threads = count > 0 ? SLO_thread_count(count, threads) : 1;
+	runs = threads > 1 ? threads * SLO_BATCH_RUNS_PER_THREAD : 1;
+	runs = runs < count ? runs : (count > 0 ? count : 1);
+
+	/* A run ends once its slot reaches its share of the total */
+	batch.first[0] = 0;
+	batch.start[0] = 0;
+	for (i = 0, r = 0; i < count; i++) {
+		slot += SLO_encode_batch_bound(&items[i]);
+		if (r + 1 < runs && slot >= total / runs * (r + 1)) {
+			batch.first[++r] = i + 1;
+			batch.start[r] = slot;
+		}
+	}
+	runs = r + 1;
+	batch.first[runs] = count;
+
+	batch.items = items;
+	batch.offsets = offsets;
+	batch.out = (unsigned char *) SLO_alloc(allocator, total ? total : 1);
+	if (!batch.out) {
+		return NULL;
+	}
+	if (runs == 1) {
+		SLO_encode_batch_run(&batch, 0);
+	}
+	else {
+		SLO_parallel_for(runs, threads, SLO_encode_batch_run, &batch);
+	}
+
+	/* Each run only moves down, as it is no larger than its slot */
+	for (r = 0, p = 0; r < runs; r++) {
+		shift = batch.start[r] - p;
+		if (shift > 0) {
+			memmove(batch.out + p, batch.out + batch.start[r], batch.end[r] - batch.start[r]);
+			for (i = batch.first[r]; i < batch.first[r + 1]; i++) {
+				offsets[i] -= shift;
+			}
+		}
+		p += batch.end[r] - batch.start[r];
+	}
+	offsets[count] = p;
+	return batch.out;
+}
+
+size_t SLO_encode_into(const void *data, const SLO_desc *desc, void *buffer, size_t capacity) {
+	return SLO_encode_into_ex(data, desc, buffer, capacity, NULL);
+}
+
+size_t SLO_encode_into_ex(
+	const void *data, const SLO_desc *desc, void *buffer, size_t capacity,
+	const SLO_allocator *allocator
+) {
+	SLO_encoder enc;
+	size_t max_size;
+
+	if (data == NULL || buffer == NULL) {
+		return 0;
+	}
+
+	max_size = SLO_encode_bound(desc);
+	if (max_size == 0) {
+		return 0;
+	}
+	if (capacity >= max_size) {
+		return SLO_encode_bytes(data, desc, (unsigned char *)buffer, 1, allocator);
+	}
+
+	/* A smaller buffer may still suffice for the actual output. Go through the
+	streaming encoder, which checks every write against the capacity. The desc
+	is valid, so that is the only way for it to fail. */
+	if (
+		desc->strip_height != 0 ||
+		!SLO_encoder_init_buffer(&enc, desc, buffer, capacity) ||
+		!SLO_encoder_push_rows(&enc, data, desc->height, 0) ||
+		!SLO_encoder_finish(&enc)
+	) {
+		return SLO_ENCODE_MORE_SPACE;
+	}
+	if (!SLO_check_bound((unsigned char *)buffer, (size_t)enc.len, data, desc, allocator)) {
+		return 0;
+	}
+	return (size_t)enc.len;
+}
+
+static int SLO_encoder_flush(SLO_encoder *enc) {
+	if (enc->buffer_len > 0 && !enc->write(enc->user, enc->buffer, enc->buffer_len)) {
+		enc->error = 1;
+		return 0;
+	}
+	enc->len += enc->buffer_len;
+	enc->buffer_len = 0;
+	return 1;
+}
+
+static int SLO_buffer_write(void *user, const void *data, int size) {
+	SLO_encoder *enc = (SLO_encoder *)user;
+	if ((unsigned long long)size > enc->out_capacity - enc->len) {
+		return 0;
+	}
+	memcpy(enc->out + enc->len, data, size);
+	return 1;
+}
+
+int SLO_encoder_init(SLO_encoder *enc, const SLO_desc *desc, SLO_write_fn write, void *user) {
+	size_t header_len = 0;
+
+	if (enc == NULL) {
+		return 0;
+	}
+
+	enc->error = 1;
+	if (
+		write == NULL || !SLO_desc_valid(desc) || desc->strip_height != 0 ||
+		desc->width > SLO_SIZE_MAX / desc->channels
+	) {
+		return 0;
+	}
+
+	enc->desc = *desc;
+	enc->write = write;
+	enc->user = user;
+	enc->out = NULL;
+	enc->out_capacity = 0;
+	enc->rows = 0;
+	enc->len = 0;
+	enc->error = 0;
+	enc->buffer_len = 0;
+	SLO_state_init(&enc->state, SLO_INDEX_SIZE(desc));
+	SLO_write_header(enc->buffer, &header_len, desc);
+	enc->buffer_len = (int)header_len;
+	return 1;
+}
+
+int SLO_encoder_init_buffer(SLO_encoder *enc, const SLO_desc *desc, void *buffer, size_t capacity) {
+	if (!SLO_encoder_init(enc, desc, SLO_buffer_write, enc)) {
+		return 0;
+	}
+	enc->out = (unsigned char *)buffer;
+	enc->out_capacity = buffer ? capacity : 0;
+	return 1;
+}
+
+int SLO_encoder_push_rows(SLO_encoder *enc, const void *rows, int count, size_t stride) {
+	const unsigned char *row = (const unsigned char *)rows;
+	int channels, y;
+
+	if (enc == NULL) {
+		return 0;
+	}
+	if (enc->error || rows == NULL || count < 0 || (unsigned int)count > enc->desc.height - enc->rows) {
+		enc->error = 1;
+		return 0;
+	}
+
+	channels = enc->desc.channels;
+	if (stride == 0) {
+		stride = (size_t)enc->desc.width * channels;
+	}
+
+	for (y = 0; y < count; y++, row += stride) {
+		unsigned int x = 0;
+		while (x < enc->desc.width) {
+			/* Encode as many pixels as are guaranteed to fit into the buffer.
+			A run carried over from the previous call may add one byte. */
+			int n = (SLO_ENCODER_BUFFER - 1 - enc->buffer_len) / (channels + 1);
+			if (n == 0) {
+				if (!SLO_encoder_flush(enc)) {
+					return 0;
+				}
+				continue;
+			}
+			if ((unsigned int)n > enc->desc.width - x) {
+				n = enc->desc.width - x;
+			}
+			enc->buffer_len += (int)SLO_encode_chunks(
+				&enc->state, enc->buffer + enc->buffer_len,
+				row + (size_t)x * channels, (size_t)n * channels, &enc->desc
+			);
+			x += n;
+		}
+	}
+
+	enc->rows += count;
+	return 1;
+}
+
+int SLO_encoder_finish(SLO_encoder *enc) {
+	if (enc == NULL) {
+		return 0;
+	}
+	if (enc->error || enc->rows != enc->desc.height) {
+		enc->error = 1;
+		return 0;
+	}
+
+	if (SLO_ENCODER_BUFFER - enc->buffer_len < 1 + (int)sizeof(SLO_padding) && !SLO_encoder_flush(enc)) {
+		return 0;
+	}
+	enc->buffer_len += (int)SLO_encode_end(&enc->state, enc->buffer + enc->buffer_len);
+	memcpy(enc->buffer + enc->buffer_len, SLO_padding, sizeof(SLO_padding));
+	enc->buffer_len += sizeof(SLO_padding);
+	if (!SLO_encoder_flush(enc)) {
+		return 0;
+	}
+
+	/* The image is complete, any further call fails */
+	enc->error = 1;
+	return 1;
+}
+
+
+/* -----------------------------------------------------------------------------
+Decoder */
+
+/* Number of header bytes up to the end of the extension block. The first 15
+bytes must be readable. */
+
+static int SLO_desc_size(const unsigned char *bytes) {
+	if (bytes[13] & SLO_HEADER_EXT) {
+		return SLO_HEADER_SIZE + 1 + bytes[14];
+	}
+	return SLO_HEADER_SIZE;
+}
+
+/* Read and validate the header and the extension block, but not the strip
+table. All SLO_desc_size() bytes must be readable. */
+
+static int SLO_read_desc(const unsigned char *bytes, SLO_desc *desc, size_t *p) {
+	unsigned int header_magic;
+	size_t ext_end;
+	int index_bits;
+
+	*p = 0;
+	header_magic = SLO_read_32(bytes, p);
+	desc->width = SLO_read_32(bytes, p);
+	desc->height = SLO_read_32(bytes, p);
+	desc->channels = bytes[(*p)++];
+	desc->colorspace = bytes[(*p)++];
+	desc->strip_height = 0;
+	desc->quality = SLO_QUALITY_NORMAL;
+	desc->recon = SLO_RECON_SHIFT;
+	desc->tolerance = 0;
+	desc->bounded = 0;
+	memset(desc->max_abs_error, 0, sizeof(desc->max_abs_error));
+	desc->index_size = 64;
+
+	if (desc->colorspace & SLO_HEADER_EXT) {
+		desc->colorspace &= ~SLO_HEADER_EXT;
+		ext_end = *p + 1 + bytes[*p];
+		if (bytes[*p] < SLO_EXT_MIN) {
+			return 0;
+		}
+		(*p)++;
+		desc->strip_height = SLO_read_32(bytes, p);
+
+		/* Check the raw bytes: a quality of 255 would wrap to 0, which a desc
+		takes to mean the default */
+		if (*p < ext_end) {
+			if (bytes[*p] > SLO_LEVELS - 1) {
+				return 0;
+			}
+			desc->quality = bytes[(*p)++] + 1;
+		}
+		if (*p < ext_end) {
+			desc->recon = bytes[(*p)++];
+		}
+		if (*p < ext_end) {
+			index_bits = bytes[(*p)++];
+			if (index_bits != 6 && index_bits != 8 && index_bits != 10) {
+				return 0;
+			}
+			desc->index_size = 1 << index_bits;
+		}
+		*p = ext_end;
+	}
+
+	return header_magic == SLO_MAGIC && SLO_desc_valid(desc);
+}
+
+/* Read and validate the whole header of an image in memory, including the
+strip table. On success p is set to the first byte after the header. */
+
+static int SLO_read_header(const unsigned char *bytes, size_t size, SLO_desc *desc, size_t *p) {
+	size_t chunks_len = size - sizeof(SLO_padding);
+	int strips, i;
+	unsigned long long prev;
+
+	if (
+		(size_t)SLO_desc_size(bytes) > chunks_len ||
+		!SLO_read_desc(bytes, desc, p)
+	) {
+		return 0;
+	}
+
+	/* Strip offsets must lie between the table and the end marker and must not
+	decrease */
+	strips = SLO_strip_count(desc);
+	if ((size_t)strips > (chunks_len - *p) / 8) {
+		return 0;
+	}
+	prev = *p + (size_t)strips * 8;
+	for (i = 0; i < strips; i++) {
+		unsigned long long offset = SLO_read_64(bytes, p);
+		if (offset < prev || offset > chunks_len) {
+			return 0;
+		}
+		prev = offset;
+	}
+	return 1;
+}
+
+/* The decoder looks up each tag byte in a table that describes the op as a
+single formula, so decoding a chunk needs no branches:
+
+	px = (px & keep) + delta + literal | (index[tag & index_mask] & from_index)
+
+where literal is the bytes following the tag, masked (RGB, RGBA), or the nibbles
+of LUMA's second byte, spread to red and blue by SLO_luma_table. The additions
+wrap per channel (SLO_ADD_8). Images with a long index use a second table, in
+which the SLO_OP_INDEX_LONG tags take from the long index instead:
+
+	px |= index_long[(tag << 8 | next byte) & long_mask] & from_long */
+
+typedef struct {
+	SLO_rgba_t keep;
+	SLO_rgba_t delta;
+	SLO_rgba_t literal;
+	SLO_rgba_t from_index;
+	SLO_rgba_t from_long;
+	unsigned char luma_mask;
+	unsigned char index_mask;
+	unsigned char len;  /* bytes following the tag */
+	unsigned char run;
+} SLO_op_t;
+
+#define SLO_IS_LIT(b)   ((b) >= SLO_OP_RGB)
+#define SLO_IS_DIFF(b)  (((b) & SLO_MASK_2) == SLO_OP_DIFF)
+#define SLO_IS_LUMA(b)  (((b) & SLO_MASK_2) == SLO_OP_LUMA)
+#define SLO_IS_LONG(b, l) ((l) && (b) >= SLO_OP_INDEX_LONG && !SLO_IS_LIT(b))
+#define SLO_IS_RUN(b, l)  (((b) & SLO_MASK_2) == SLO_OP_RUN && !SLO_IS_LIT(b) && !SLO_IS_LONG(b, l))
+#define SLO_IS_INDEX(b) (((b) & SLO_MASK_2) == SLO_OP_INDEX)
+
+#define SLO_OP_KEEP(b, l, a) ((SLO_IS_LIT(b) && (a)) || SLO_IS_INDEX(b) || SLO_IS_LONG(b, l) ? 0 : 0xff)
+#define SLO_OP_DELTA(b, diff, luma) ((unsigned char)( \
+	SLO_IS_DIFF(b) ? (diff) - 2 : SLO_IS_LUMA(b) ? ((b) & 0x3f) - (luma) : 0))
+#define SLO_OP_LEN(b, l) ( \
+	(b) == SLO_OP_RGB ? 3 : (b) == SLO_OP_RGBA ? 4 : SLO_IS_LUMA(b) || SLO_IS_LONG(b, l) ? 1 : 0)
+#define SLO_OP_L(b, l) { \
+	{{SLO_OP_KEEP(b, l, 1), SLO_OP_KEEP(b, l, 1), SLO_OP_KEEP(b, l, 1), SLO_OP_KEEP(b, l, (b) == SLO_OP_RGBA)}}, \
+	{{SLO_OP_DELTA(b, ((b) >> 4) & 0x03, 40), SLO_OP_DELTA(b, ((b) >> 2) & 0x03, 32), SLO_OP_DELTA(b, (b) & 0x03, 40), 0}}, \
+	{{SLO_IS_LIT(b) ? 0xff : 0, SLO_IS_LIT(b) ? 0xff : 0, SLO_IS_LIT(b) ? 0xff : 0, (b) == SLO_OP_RGBA ? 0xff : 0}}, \
+	{{SLO_IS_INDEX(b) ? 0xff : 0, SLO_IS_INDEX(b) ? 0xff : 0, SLO_IS_INDEX(b) ? 0xff : 0, SLO_IS_INDEX(b) ? 0xff : 0}}, \
+	{{SLO_IS_LONG(b, l) ? 0xff : 0, SLO_IS_LONG(b, l) ? 0xff : 0, SLO_IS_LONG(b, l) ? 0xff : 0, SLO_IS_LONG(b, l) ? 0xff : 0}}, \
+	SLO_IS_LUMA(b) ? 0xff : 0, SLO_IS_INDEX(b) ? 0x3f : 0, SLO_OP_LEN(b, l), SLO_IS_RUN(b, l) ? (b) & 0x3f : 0 }
+#define SLO_OP(b)      SLO_OP_L(b, 0)
+#define SLO_OP_LONG(b) SLO_OP_L(b, 1)
+#define SLO_LUMA(b) {{(b) >> 4, 0, (b) & 0x0f, 0}}
+
+#define SLO_X4(X, b)  X(b), X((b) + 1), X((b) + 2), X((b) + 3)
+#define SLO_X16(X, b) SLO_X4(X, b), SLO_X4(X, (b) + 4), SLO_X4(X, (b) + 8), SLO_X4(X, (b) + 12)
+#define SLO_X64(X, b) SLO_X16(X, b), SLO_X16(X, (b) + 16), SLO_X16(X, (b) + 32), SLO_X16(X, (b) + 48)
+#define SLO_X256(X)   SLO_X64(X, 0x00), SLO_X64(X, 0x40), SLO_X64(X, 0x80), SLO_X64(X, 0xc0)
+
+static const SLO_op_t SLO_op_table[256] = { SLO_X256(SLO_OP) };
+static const SLO_op_t SLO_op_table_long[256] = { SLO_X256(SLO_OP_LONG) };
+static const SLO_rgba_t SLO_luma_table[256] = { SLO_X256(SLO_LUMA) };
+
+/* Add the four channels of x and y, each modulo 256 */
+#define SLO_ADD_8(x, y) \
+	((((x) & 0x7f7f7f7fu) + ((y) & 0x7f7f7f7fu)) ^ (((x) ^ (y)) & 0x80808080u))
+
+/* Runs are filled, and series of SLO_OP_RGB chunks expanded, four pixels at a
+time with SSE2 or NEON. Every x86-64 and ARM64 CPU has these, so they need no
+runtime dispatch. An SLO_OP_RGB chunk is the tag followed by r, g, b, so on a
+little endian CPU a 32-bit load of a chunk shifted down by 8 bits is the pixel
+with an alpha of 0. */
+#if defined(SLO_SIMD_X86) && (defined(__SSE2__) || defined(_M_X64))
+	#define SLO_SIMD_SSE2
+#elif defined(SLO_SIMD_NEON) && !defined(__ARM_BIG_ENDIAN)
+	#define SLO_SIMD_NEON_LE
+#endif
+
+/* Write px to out[0..k). The caller's buffer has room for room >= k pixels,
+which may be written past k. */
+
+SLO_FORCE_INLINE void SLO_fill_px(SLO_rgba_t *out, SLO_rgba_t px, int k, int room) {
+	int i = 0;
+#if defined(SLO_SIMD_SSE2)
+	__m128i v = _mm_set1_epi32((int)px.v);
+	if (room - k >= 3) {
+		for (; i < k; i += 4) {
+			_mm_storeu_si128((__m128i *)(out + i), v);
+		}
+		return;
+	}
+	for (; i + 4 <= k; i += 4) {
+		_mm_storeu_si128((__m128i *)(out + i), v);
+	}
+#elif defined(SLO_SIMD_NEON_LE)
+	uint32x4_t v = vdupq_n_u32(px.v);
+	if (room - k >= 3) {
+		for (; i < k; i += 4) {
+			vst1q_u32((unsigned int *)(out + i), v);
+		}
+		return;
+	}
+	for (; i + 4 <= k; i += 4) {
+		vst1q_u32((unsigned int *)(out + i), v);
+	}
+#else
+	(void)room;
+#endif
+	for (; i < k; i++) {
+		out[i] = px;
+	}
+}
+
+/* Expand the SLO_OP_RGB chunks at bytes[p..end) into out, four at a time for
+as long as they last and room is left. alpha is the alpha of the previous
+pixel, in the top byte. All four pixels of a step are stored, but only as many
+count as lead the step with an SLO_OP_RGB tag, so a series that doesn't end on
+a multiple of 4 costs no extra step. Returns the number of pixels decoded; the
+index is left to the caller. */
+
+SLO_FORCE_INLINE int SLO_decode_rgb4(const unsigned char *bytes, size_t p, size_t end, SLO_rgba_t *out, int room, unsigned int alpha) {
+	int i = 0, lead = 4;
+#if defined(SLO_SIMD_SSE2)
+	const __m128i tags = _mm_set1_epi32(SLO_OP_RGB);
+	const __m128i low = _mm_set1_epi32(0xff);
+	const __m128i a = _mm_set1_epi32((int)alpha);
+	int m;
+	for (; lead == 4 && i + 4 <= room && p + 16 <= end; i += lead, p += (size_t)lead * 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(bytes + p));
+		m = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(v, low), tags));
+		lead = ((m & 0x000f) == 0x000f) + ((m & 0x00ff) == 0x00ff) + ((m & 0x0fff) == 0x0fff) + (m == 0xffff);
+		_mm_storeu_si128((__m128i *)(out + i), _mm_or_si128(_mm_srli_epi32(v, 8), a));
+	}
+#elif defined(SLO_SIMD_NEON_LE)
+	const uint32x4_t tags = vdupq_n_u32(SLO_OP_RGB);
+	const uint32x4_t low = vdupq_n_u32(0xff);
+	const uint32x4_t a = vdupq_n_u32(alpha);
+	unsigned int m;
+	for (; lead == 4 && i + 4 <= room && p + 16 <= end; i += lead, p += (size_t)lead * 4) {
+		uint32x4_t v = vreinterpretq_u32_u8(vld1q_u8(bytes + p));
+		uint32x4_t eq = vceqq_u32(vandq_u32(v, low), tags);
+		m = vgetq_lane_u32(eq, 0) & 1;
+		lead = m;
+		m &= vgetq_lane_u32(eq, 1);
+		lead += m;
+		m &= vgetq_lane_u32(eq, 2);
+		lead += m;
+		m &= vgetq_lane_u32(eq, 3);
+		lead += m;
+		vst1q_u32((unsigned int *)(out + i), vorrq_u32(vshrq_n_u32(v, 8), a));
+	}
+#else
+	(void)bytes; (void)p; (void)end; (void)out; (void)room; (void)alpha; (void)lead;
+#endif
+	return i;
+}
+
+/* Decode up to n pixels into out, continuing from the given state. Only chunks
+that start before end are read, but a chunk may extend up to 4 bytes past it.
+Returns the number of pixels decoded, which is less than n only if the chunks
+ran out. This is the loop for images with a long index; SLO_decode_pixels is
+the same without it. */
+
+static int SLO_decode_pixels_long(SLO_state *state, const unsigned char *bytes, size_t *pp, size_t end, SLO_rgba_t *out, int n) {
+	SLO_rgba_t *index = state->index;
+	SLO_rgba_t *index_long = state->index_long;
+	SLO_rgba_t px = state->px;
+	int run = state->run;
+	int long_mask = state->long_mask;
+	size_t p = *pp;
+	int i = 0, k, b1;
+	unsigned int literal, v, hash;
+	const SLO_op_t *op;
+
+	while (i < n) {
+		if (run > 0) {
+			k = run < n - i ? run : n - i;
+			run -= k;
+			SLO_fill_px(out + i, px, k, n - i);
+			i += k;
+			continue;
+		}
+
+		if (p >= end) {
+			break;
+		}
+
+		b1 = bytes[p++];
+		op = &SLO_op_table_long[b1];
+
+		memcpy(&literal, bytes + p, 4);
+		literal = (literal & op->literal.v) | SLO_luma_table[bytes[p] & op->luma_mask].v;
+		v = SLO_ADD_8(op->delta.v, literal);
+		px.v = SLO_ADD_8(px.v & op->keep.v, v) |
+			(index[b1 & op->index_mask].v & op->from_index.v) |
+			(index_long[((b1 << 8) | bytes[p]) & long_mask].v & op->from_long.v);
+		run = op->run;
+		p += op->len;
+
+		hash = SLO_COLOR_HASH(px);
+		index[hash % 64] = px;
+		index_long[hash & long_mask] = px;
+		out[i++] = px;
+
+		if (b1 == SLO_OP_RGB && p < end && bytes[p] == SLO_OP_RGB) {
+			k = SLO_decode_rgb4(bytes, p, end, out + i, n - i, px.v & 0xff000000u);
+			for (p += (size_t)k * 4, k += i; i < k; i++) {
+				px = out[i];
+				hash = SLO_COLOR_HASH(px);
+				index[hash % 64] = px;
+				index_long[hash & long_mask] = px;
+			}
+		}
+	}
+
+	state->px = px;
+	state->run = run;
+	*pp = p;
+	return i;
+}
+
+static int SLO_decode_pixels(SLO_state *state, const unsigned char *bytes, size_t *pp, size_t end, SLO_rgba_t *out, int n) {
+	SLO_rgba_t *index = state->index;
+	SLO_rgba_t px = state->px;
+	int run = state->run;
+	size_t p = *pp;
+	int i = 0, k, b1;
+	unsigned int literal, v;
+	const SLO_op_t *op;
+
+	if (state->long_mask) {
+		return SLO_decode_pixels_long(state, bytes, pp, end, out, n);
+	}
+
+	while (i < n) {
 		if (run > 0) {
-			run--;
+			k = run < n - i ? run : n - i;
+			run -= k;
+			SLO_fill_px(out + i, px, k, n - i);
+			i += k;
+			continue;
+		}
+
+		if (p >= end) {
+			break;
+		}
+
+		b1 = bytes[p++];
+		op = &SLO_op_table[b1];
+
+		/* delta and literal don't depend on px, so only the last addition is on
+		the chain from one pixel to the next */
+		memcpy(&literal, bytes + p, 4);
+		literal = (literal & op->literal.v) | SLO_luma_table[bytes[p] & op->luma_mask].v;
+		v = SLO_ADD_8(op->delta.v, literal);
+		px.v = SLO_ADD_8(px.v & op->keep.v, v) | (index[b1 & op->index_mask].v & op->from_index.v);
+		run = op->run;
+		p += op->len;
+
+		index[SLO_COLOR_HASH(px) % 64] = px;
+		out[i++] = px;
+
+		/* Noise is mostly SLO_OP_RGB chunks in a row. A single one, as in photos,
+		is the common case there, so the next tag is checked before the SIMD
+		load. */
+		if (b1 == SLO_OP_RGB && p < end && bytes[p] == SLO_OP_RGB) {
+			k = SLO_decode_rgb4(bytes, p, end, out + i, n - i, px.v & 0xff000000u);
+			for (p += (size_t)k * 4, k += i; i < k; i++) {
+				px = out[i];
+				index[SLO_COLOR_HASH(px) % 64] = px;
+			}
+		}
+	}
+
+	state->px = px;
+	state->run = run;
+	*pp = p;
+	return i;
+}
+
+/* Decode rows of width pixels from the chunks in bytes[p..chunks_len), starting
+with a fresh state, into rows that are stride bytes apart. If the chunks run out
+early, the last pixel is repeated. */
+
+static void SLO_decode_chunks(
+	const unsigned char *bytes, size_t p, size_t chunks_len,
+	unsigned char *pixels, unsigned int y, unsigned int rows, size_t stride,
+	int channels, SLO_store_fn store, const SLO_desc *desc
+) {
+	SLO_rgba_t batch[SLO_DECODE_BATCH];
+	SLO_rgba_t bias_row[SLO_BIAS_LEN];
+	const SLO_rgba_t *bias;
+	SLO_state state;
+	size_t px_pos, width = desc->width;
+	unsigned int y_end = y + rows;
+	int level = SLO_LEVEL(desc);
+	int dither = desc->recon == SLO_RECON_DITHER;
+	int batch_len, n;
+
+	SLO_state_init(&state, SLO_INDEX_SIZE(desc));
+	bias = SLO_recon_bias(bias_row, desc, y);
+
+	/* Tightly packed rows are decoded as one long row, unless the offsets
+	differ from row to row */
+	if (stride == width * channels && !dither) {
+		width *= rows;
+		y_end = y + 1;
+	}
+
+	for (; y < y_end; y++, pixels += stride) {
+		if (dither) {
+			bias = SLO_recon_bias(bias_row, desc, y);
+		}
+		for (px_pos = 0; px_pos < width; px_pos += batch_len) {
+			batch_len = SLO_DECODE_BATCH;
+			if (width - px_pos < SLO_DECODE_BATCH) {
+				batch_len = (int)(width - px_pos);
+			}
+
+			n = SLO_decode_pixels(&state, bytes, &p, chunks_len, batch, batch_len);
+			while (n < batch_len) {
+				batch[n++] = state.px;
+			}
+
+			store(pixels + px_pos * channels, batch, batch_len, level, SLO_BIAS_TAIL(bias, px_pos & 3));
+		}
+	}
+}
+
+/* Each strip decodes straight into its own rows of the output */
+
+typedef struct {
+	const unsigned char *bytes;
+	unsigned char *pixels;
+	const SLO_desc *desc;
+	SLO_store_fn store;
+	size_t table;
+	size_t chunks_len;
+	size_t stride;
+	int channels;
+} SLO_decode_job_t;
+
+static void SLO_decode_strip(void *ctx, int strip) {
+	SLO_decode_job_t *job = (SLO_decode_job_t *)ctx;
+	const SLO_desc *desc = job->desc;
+	int strips = SLO_strip_count(desc);
+	size_t entry = job->table + (size_t)strip * 8;
+	size_t start = (size_t)SLO_read_64(job->bytes, &entry);
+	size_t end = strip + 1 < strips ? (size_t)SLO_read_64(job->bytes, &entry) : job->chunks_len;
+	unsigned int y = strip * desc->strip_height;
+	unsigned int rows = desc->height - y < desc->strip_height ? desc->height - y : desc->strip_height;
+
+	SLO_decode_chunks(
+		job->bytes, start, end,
+		job->pixels + y * job->stride, y, rows, job->stride,
+		job->channels, job->store, desc
+	);
+}
+
+/* Read the header and set up everything in the job but the output. Returns the
+offset of the first chunk, or 0 on failure. */
+
+static size_t SLO_decode_begin(SLO_decode_job_t *job, const void *data, size_t size, SLO_desc *desc, int channels) {
+	size_t p;
+
+	if (
+		data == NULL || desc == NULL ||
+		(channels != 0 && channels != 3 && channels != 4) ||
+		size < SLO_HEADER_SIZE + sizeof(SLO_padding)
+	) {
+		return 0;
+	}
+
+	job->bytes = (const unsigned char *)data;
+	if (!SLO_read_header(job->bytes, size, desc, &p)) {
+		return 0;
+	}
+
+	if (channels == 0) {
+		channels = desc->channels;
+	}
+
+	job->desc = desc;
+	job->store = SLO_store_kernel(desc, channels);
+	job->chunks_len = size - sizeof(SLO_padding);
+	job->channels = channels;
+	return p;
+}
+
+static void SLO_decode_run(SLO_decode_job_t *job, size_t p, int threads) {
+	const SLO_desc *desc = job->desc;
+	int strips = SLO_strip_count(desc);
+
+	if (strips == 0) {
+		SLO_decode_chunks(
+			job->bytes, p, job->chunks_len,
+			job->pixels, 0, desc->height, job->stride,
+			job->channels, job->store, desc
+		);
+	}
+	else {
+		/* The strip table ends where the chunks of the first strip begin */
+		job->table = p - (size_t)strips * 8;
+		SLO_parallel_for(strips, threads, SLO_decode_strip, job);
+	}
+}
+
+static void *SLO_decode_impl(const void *data, size_t size, SLO_desc *desc, int channels, int threads, const SLO_allocator *allocator) {
+	SLO_decode_job_t job;
+	size_t p, px_len;
+
+	p = SLO_decode_begin(&job, data, size, desc, channels);
+	if (p == 0) {
+		return NULL;
+	}
+
+	px_len = SLO_image_size(desc, job.channels);
+	if (px_len == 0) {
+		return NULL;
+	}
+	job.pixels = (unsigned char *) SLO_alloc(allocator, px_len);
+	if (!job.pixels) {
+		return NULL;
+	}
+	job.stride = (size_t)desc->width * job.channels;
+
+	SLO_decode_run(&job, p, threads);
+	return job.pixels;
+}
+
+void *SLO_decode(const void *data, int size, SLO_desc *desc, int channels) {
+	if (size < 0) {
+		return NULL;
+	}
+	return SLO_decode_impl(data, size, desc, channels, 1, NULL);
+}
+
+void *SLO_decode64(const void *data, size_t size, SLO_desc *desc, int channels) {
+	return SLO_decode_impl(data, size, desc, channels, 1, NULL);
+}
+
+void *SLO_decode_parallel(const void *data, size_t size, SLO_desc *desc, int channels, int threads) {
+	return SLO_decode_impl(data, size, desc, channels, threads, NULL);
+}
+
+void *SLO_decode_ex(
+	const void *data, size_t size, SLO_desc *desc, int channels, int threads,
+	const SLO_allocator *allocator
+) {
+	return SLO_decode_impl(data, size, desc, channels, threads, allocator);
+}
+
+/* The headers of a batch are read up front, to find the size of the buffer.
+After that, each image is decoded by one thread, strips and all. */
+
+typedef struct {
+	SLO_decode_item *items;
+	SLO_decode_job_t *jobs;
+	size_t *starts;
+} SLO_decode_batch_t;
+
+static void SLO_decode_batch_item(void *ctx, int i) {
+	SLO_decode_batch_t *batch = (SLO_decode_batch_t *)ctx;
+	if (batch->items[i].ok) {
+		SLO_decode_run(&batch->jobs[i], batch->starts[i], 1);
+	}
+}
+
+void *SLO_decode_batch(
+	SLO_decode_item *items, int count, int channels, int threads,
+	const SLO_allocator *allocator
+) {
+	SLO_decode_batch_t batch;
+	SLO_decode_job_t *job;
+	unsigned char *pixels;
+	size_t total = 0, px_len;
+	int i;
+
+	if (items == NULL || count < 0 || (channels != 0 && channels != 3 && channels != 4)) {
+		return NULL;
+	}
+
+	batch.items = items;
+	batch.jobs = (SLO_decode_job_t *) SLO_alloc(allocator, count ? count * sizeof(SLO_decode_job_t) : 1);
+	batch.starts = (size_t *) SLO_alloc(allocator, count ? count * sizeof(size_t) : 1);
+	if (!batch.jobs || !batch.starts) {
+		goto fail;
+	}
+
+	for (i = 0; i < count; i++) {
+		job = &batch.jobs[i];
+		items[i].offset = total;
+		batch.starts[i] = SLO_decode_begin(job, items[i].data, items[i].size, &items[i].desc, channels);
+		px_len = batch.starts[i] ? SLO_image_size(&items[i].desc, job->channels) : 0;
+		items[i].ok = px_len != 0 && px_len <= SLO_SIZE_MAX - total;
+		if (items[i].ok) {
+			job->stride = (size_t)items[i].desc.width * job->channels;
+			total += px_len;
+		}
+	}
+
+	pixels = (unsigned char *) SLO_alloc(allocator, total ? total : 1);
+	if (!pixels) {
+		goto fail;
+	}
+	for (i = 0; i < count; i++) {
+		batch.jobs[i].pixels = pixels + items[i].offset;
+	}
+
+	SLO_parallel_for(count, threads, SLO_decode_batch_item, &batch);
+
+	SLO_release(allocator, batch.jobs);
+	SLO_release(allocator, batch.starts);
+	return pixels;
+
+fail:
+	SLO_release(allocator, batch.jobs);
+	SLO_release(allocator, batch.starts);
+	return NULL;
+}
+
+int SLO_decode_header(const void *data, size_t size, SLO_desc *desc) {
+	SLO_decode_job_t job;
+	return SLO_decode_begin(&job, data, size, desc, 0) != 0;
+}
+
+int SLO_decode_into(
+	const void *data, size_t size, SLO_desc *desc, int channels,
+	void *pixels, size_t pixels_size, size_t stride, int threads
+) {
+	SLO_decode_job_t job;
+	size_t p, row_len;
+
+	p = SLO_decode_begin(&job, data, size, desc, channels);
+	if (p == 0 || pixels == NULL || desc->width > SLO_SIZE_MAX / job.channels) {
+		return 0;
+	}
+
+	row_len = (size_t)desc->width * job.channels;
+	if (stride == 0) {
+		stride = row_len;
+	}
+
+	/* The last row only needs row_len bytes, not a full stride */
+	if (
+		stride < row_len || pixels_size < row_len ||
+		desc->height - 1 > (pixels_size - row_len) / stride
+	) {
+		return 0;
+	}
+
+	job.pixels = (unsigned char *)pixels;
+	job.stride = stride;
+	SLO_decode_run(&job, p, threads);
+	return 1;
+}
+
+static int SLO_measure_error_impl(const void *data, size_t size, const void *pixels, unsigned char *max_error, const SLO_allocator *allocator) {
+	SLO_decoder dec;
+	const unsigned char *bytes = (const unsigned char *)data;
+	const unsigned char *src = (const unsigned char *)pixels;
+	unsigned char *row = NULL;
+	size_t used = 0, row_len = 0, i;
+	int n = 0, end, d, ok = 0;
+
+	if (data == NULL || pixels == NULL || max_error == NULL || !SLO_decoder_init_ex(&dec, 0, allocator)) {
+		return 0;
+	}
+	memset(max_error, 0, 4);
+
+	do {
+		end = used == size;
+		n = SLO_decoder_feed(&dec, bytes + used, size - used);
+		if (n < 0) {
+			break;
 		}
-		else if (p < chunks_len) {
-			int b1 = bytes[p++];
+		used += n;
 
-			if (b1 == SLO_OP_RGB) {
-				px.rgba.r = bytes[p++];
-				px.rgba.g = bytes[p++];
-				px.rgba.b = bytes[p++];
+		if (!row) {
+			if (SLO_decoder_read_rows(&dec, NULL, 0, 0) < 0) {
+				break;
 			}
-			else if (b1 == SLO_OP_RGBA) {
-				px.rgba.r = bytes[p++];
-				px.rgba.g = bytes[p++];
-				px.rgba.b = bytes[p++];
-				px.rgba.a = bytes[p++];
+			if (!dec.header) {
+				continue;
 			}
-			else if ((b1 & SLO_MASK_2) == SLO_OP_INDEX) {
-				px = index[b1];
+			row_len = (size_t)dec.desc.width * dec.channels;
+			row = (unsigned char *) SLO_alloc(allocator, row_len);
+			if (!row) {
+				break;
 			}
-			else if ((b1 & SLO_MASK_2) == SLO_OP_DIFF) {
-				px.rgba.r += ((b1 >> 4) & 0x03) - 2;
-				px.rgba.g += ((b1 >> 2) & 0x03) - 2;
-				px.rgba.b += ( b1       & 0x03) - 2;
+		}
+
+		while ((n = SLO_decoder_read_rows(&dec, row, 1, 0)) == 1) {
+			for (i = 0; i < row_len; i++) {
+				d = row[i] > src[i] ? row[i] - src[i] : src[i] - row[i];
+				if (d > max_error[i % dec.channels]) {
+					max_error[i % dec.channels] = d;
+				}
 			}
-			else if ((b1 & SLO_MASK_2) == SLO_OP_LUMA) {
-				int b2 = bytes[p++];
-				int vg = (b1 & 0x3f) - 32;
-				px.rgba.r += vg - 8 + ((b2 >> 4) & 0x0f);
-				px.rgba.g += vg;
-				px.rgba.b += vg - 8 +  (b2       & 0x0f);
+			src += row_len;
+		}
+		if (n < 0) {
+			break;
+		}
+		ok = dec.rows == dec.desc.height;
+	} while (!ok && !end);
+
+	SLO_decoder_free(&dec);
+	SLO_release(allocator, row);
+	return ok;
+}
+
+/* A region is decoded strip by strip like a whole image. Each strip is
+decoded from its start up to the last pixel of the region in it; the pixels
+before the region and between its rows are decoded but not stored. */
+
+typedef struct {
+	SLO_decode_job_t job;  /* pixels is the first row of the region */
+	unsigned int x, y, w, h;
+	int first_strip;
+} SLO_region_job_t;
+
+/* Decode n pixels without storing them */
+static void SLO_decode_skip(SLO_state *state, const unsigned char *bytes, size_t *p, size_t end, size_t n, SLO_rgba_t *batch) {
+	int batch_len;
+	for (; n > 0; n -= batch_len) {
+		batch_len = n < SLO_DECODE_BATCH ? (int)n : SLO_DECODE_BATCH;
+		SLO_decode_pixels(state, bytes, p, end, batch, batch_len);
+	}
+}
+
+static void SLO_decode_region_rows(
+	SLO_region_job_t *region, size_t p, size_t end, unsigned int y, unsigned int rows
+) {
+	const SLO_decode_job_t *job = &region->job;
+	const SLO_desc *desc = job->desc;
+	SLO_rgba_t batch[SLO_DECODE_BATCH];
+	SLO_rgba_t bias_row[SLO_BIAS_LEN];
+	const SLO_rgba_t *bias = NULL;
+	SLO_state state;
+	unsigned int y_end = y + rows, x;
+	int level = SLO_LEVEL(desc);
+	int batch_len, n;
+	unsigned char *dst;
+
+	if (y_end > region->y + region->h) {
+		y_end = region->y + region->h;
+	}
+
+	SLO_state_init(&state, SLO_INDEX_SIZE(desc));
+	if (y < region->y) {
+		SLO_decode_skip(&state, job->bytes, &p, end, (size_t)(region->y - y) * desc->width, batch);
+		y = region->y;
+	}
+
+	for (; y < y_end; y++) {
+		if (bias == NULL || desc->recon == SLO_RECON_DITHER) {
+			bias = SLO_recon_bias(bias_row, desc, y);
+		}
+		SLO_decode_skip(&state, job->bytes, &p, end, region->x, batch);
+
+		dst = job->pixels + (size_t)(y - region->y) * job->stride;
+		for (x = region->x; x < region->x + region->w; x += batch_len) {
+			batch_len = SLO_DECODE_BATCH;
+			if (region->x + region->w - x < SLO_DECODE_BATCH) {
+				batch_len = (int)(region->x + region->w - x);
 			}
-			else if ((b1 & SLO_MASK_2) == SLO_OP_RUN) {
-				run = (b1 & 0x3f);
+
+			n = SLO_decode_pixels(&state, job->bytes, &p, end, batch, batch_len);
+			while (n < batch_len) {
+				batch[n++] = state.px;
 			}
 
-			index[SLO_COLOR_HASH(px) % 64] = px;
+			job->store(dst, batch, batch_len, level, SLO_BIAS_TAIL(bias, x & 3));
+			dst += (size_t)batch_len * job->channels;
 		}
 
-		pixels[px_pos + 0] = px.rgba.r<<1;
-		pixels[px_pos + 1] = px.rgba.g<<1;
-		pixels[px_pos + 2] = px.rgba.b<<1;
-		
-		if (channels == 4) {
-			pixels[px_pos + 3] = px.rgba.a;
+		if (y + 1 < y_end) {
+			SLO_decode_skip(&state, job->bytes, &p, end, desc->width - region->x - region->w, batch);
 		}
 	}
+}
 
-	return pixels;
+static void SLO_decode_region_strip(void *ctx, int item) {
+	SLO_region_job_t *region = (SLO_region_job_t *)ctx;
+	const SLO_decode_job_t *job = &region->job;
+	const SLO_desc *desc = job->desc;
+	int strips = SLO_strip_count(desc);
+	int strip = region->first_strip + item;
+	size_t entry = job->table + (size_t)strip * 8;
+	size_t start = (size_t)SLO_read_64(job->bytes, &entry);
+	size_t end = strip + 1 < strips ? (size_t)SLO_read_64(job->bytes, &entry) : job->chunks_len;
+	unsigned int y = strip * desc->strip_height;
+	unsigned int rows = desc->height - y < desc->strip_height ? desc->height - y : desc->strip_height;
+
+	SLO_decode_region_rows(region, start, end, y, rows);
+}
+
+void *SLO_decode_region(
+	const void *data, size_t size, SLO_desc *desc, int channels,
+	unsigned int x, unsigned int y, unsigned int w, unsigned int h, int threads
+) {
+	return SLO_decode_region_ex(data, size, desc, channels, x, y, w, h, threads, NULL);
+}
+
+void *SLO_decode_region_ex(
+	const void *data, size_t size, SLO_desc *desc, int channels,
+	unsigned int x, unsigned int y, unsigned int w, unsigned int h, int threads,
+	const SLO_allocator *allocator
+) {
+	SLO_region_job_t region;
+	size_t p, px_len;
+	int strips, last_strip;
+
+	p = SLO_decode_begin(&region.job, data, size, desc, channels);
+	if (
+		p == 0 || w == 0 || h == 0 ||
+		x >= desc->width || w > desc->width - x ||
+		y >= desc->height || h > desc->height - y
+	) {
+		return NULL;
+	}
+
+	region.x = x;
+	region.y = y;
+	region.w = w;
+	region.h = h;
+	px_len = (size_t)w * h;
+	if (px_len / w != h || px_len > SLO_SIZE_MAX / region.job.channels) {
+		return NULL;
+	}
+	region.job.stride = (size_t)w * region.job.channels;
+	region.job.pixels = (unsigned char *) SLO_alloc(allocator, px_len * region.job.channels);
+	if (!region.job.pixels) {
+		return NULL;
+	}
+
+	strips = SLO_strip_count(desc);
+	if (strips == 0) {
+		SLO_decode_region_rows(&region, p, region.job.chunks_len, 0, desc->height);
+	}
+	else {
+		region.job.table = p - (size_t)strips * 8;
+		region.first_strip = y / desc->strip_height;
+		last_strip = (y + h - 1) / desc->strip_height;
+		SLO_parallel_for(last_strip - region.first_strip + 1, threads, SLO_decode_region_strip, &region);
+	}
+	return region.job.pixels;
+}
+
+/* A scaled image is decoded strip by strip. sums holds the sums of the block
+row that is being decoded, one per output channel; it is written to the output
+once the block row is complete. */
+
+typedef struct {
+	SLO_decode_job_t job;  /* pixels and stride are those of the output */
+	int scale;
+	int scale_bits;
+	size_t out_width;
+	unsigned int *sums;    /* a row of sums for each thread */
+} SLO_scaled_job_t;
+
+static void SLO_decode_scaled_rows(
+	const SLO_scaled_job_t *scaled, size_t p, size_t end, unsigned int y, unsigned int rows,
+	unsigned int *sums
+) {
+	const SLO_decode_job_t *job = &scaled->job;
+	const SLO_desc *desc = job->desc;
+	SLO_rgba_t batch[SLO_DECODE_BATCH];
+	SLO_rgba_t bias_row[SLO_BIAS_LEN];
+	unsigned char row[SLO_DECODE_BATCH * 4];
+	const SLO_rgba_t *bias = NULL;
+	SLO_state state;
+	unsigned int y_end = y + rows, x, block_rows, cols, count;
+	int level = SLO_LEVEL(desc);
+	int channels = job->channels;
+	int batch_len, n, i, k;
+	unsigned int *sum;
+	unsigned char *dst;
+	size_t ox;
+
+	SLO_state_init(&state, SLO_INDEX_SIZE(desc));
+	for (; y < y_end; y++) {
+		if (bias == NULL || desc->recon == SLO_RECON_DITHER) {
+			bias = SLO_recon_bias(bias_row, desc, y);
+		}
+
+		for (x = 0; x < desc->width; x += batch_len) {
+			batch_len = SLO_DECODE_BATCH;
+			if (desc->width - x < SLO_DECODE_BATCH) {
+				batch_len = (int)(desc->width - x);
+			}
+
+			n = SLO_decode_pixels(&state, job->bytes, &p, end, batch, batch_len);
+			while (n < batch_len) {
+				batch[n++] = state.px;
+			}
+			job->store(row, batch, batch_len, level, SLO_BIAS_TAIL(bias, x & 3));
+
+			for (i = 0; i < batch_len; i++) {
+				sum = sums + ((x + i) >> scaled->scale_bits) * channels;
+				for (k = 0; k < channels; k++) {
+					sum[k] += row[i * channels + k];
+				}
+			}
+		}
+
+		/* The block row is complete */
+		if ((y + 1) % scaled->scale == 0 || y + 1 == desc->height) {
+			block_rows = y % scaled->scale + 1;
+			dst = job->pixels + (size_t)(y >> scaled->scale_bits) * job->stride;
+			for (ox = 0; ox < scaled->out_width; ox++) {
+				cols = desc->width - ox * scaled->scale;
+				cols = cols < (unsigned int)scaled->scale ? cols : (unsigned int)scaled->scale;
+				count = cols * block_rows;
+				for (k = 0; k < channels; k++) {
+					dst[ox * channels + k] = (sums[ox * channels + k] + count / 2) / count;
+					sums[ox * channels + k] = 0;
+				}
+			}
+		}
+	}
+}
+
+static void SLO_decode_scaled_strip(void *ctx, int thread, int strip) {
+	SLO_scaled_job_t *scaled = (SLO_scaled_job_t *)ctx;
+	const SLO_decode_job_t *job = &scaled->job;
+	const SLO_desc *desc = job->desc;
+	int strips = SLO_strip_count(desc);
+	size_t entry = job->table + (size_t)strip * 8;
+	size_t start = (size_t)SLO_read_64(job->bytes, &entry);
+	size_t end = strip + 1 < strips ? (size_t)SLO_read_64(job->bytes, &entry) : job->chunks_len;
+	unsigned int y = strip * desc->strip_height;
+	unsigned int rows = desc->height - y < desc->strip_height ? desc->height - y : desc->strip_height;
+	unsigned int *sums = scaled->sums + (size_t)thread * scaled->out_width * job->channels;
+
+	/* The sums are back to 0 after every block row, so a thread can go on
+	with its next strip */
+	SLO_decode_scaled_rows(scaled, start, end, y, rows, sums);
+}
+
+void *SLO_decode_scaled(const void *data, size_t size, SLO_desc *desc, int channels, int scale, int threads) {
+	return SLO_decode_scaled_ex(data, size, desc, channels, scale, threads, NULL);
+}
+
+void *SLO_decode_scaled_ex(
+	const void *data, size_t size, SLO_desc *desc, int channels, int scale, int threads,
+	const SLO_allocator *allocator
+) {
+	SLO_scaled_job_t scaled;
+	SLO_desc out_desc;
+	size_t p, px_len, sums_len;
+	int strips, i, parallel;
+
+	if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+		return NULL;
+	}
+	p = SLO_decode_begin(&scaled.job, data, size, desc, channels);
+	if (p == 0) {
+		return NULL;
+	}
+
+	scaled.scale = scale;
+	scaled.scale_bits = scale == 8 ? 3 : scale / 2;
+	scaled.out_width = (desc->width - 1) / scale + 1;
+	out_desc = *desc;
+	out_desc.width = (unsigned int)scaled.out_width;
+	out_desc.height = (desc->height - 1) / scale + 1;
+	px_len = SLO_image_size(&out_desc, scaled.job.channels);
+	if (px_len == 0) {
+		return NULL;
+	}
+
+	/* Strips decoded in parallel need a row of sums for each thread, which
+	are all allocated here, before the threads start */
+	strips = SLO_strip_count(desc);
+	parallel = strips > 0 && desc->strip_height % scale == 0 && threads != 1;
+	threads = parallel ? SLO_thread_count(strips, threads) : 1;
+	sums_len = scaled.out_width * scaled.job.channels * sizeof(unsigned int);
+	if (sums_len > SLO_SIZE_MAX / threads) {
+		return NULL;
+	}
+	sums_len *= threads;
+
+	scaled.job.stride = scaled.out_width * scaled.job.channels;
+	scaled.job.pixels = (unsigned char *) SLO_alloc(allocator, px_len);
+	scaled.sums = (unsigned int *) SLO_alloc(allocator, sums_len);
+	if (!scaled.job.pixels || !scaled.sums) {
+		SLO_release(allocator, scaled.sums);
+		SLO_release(allocator, scaled.job.pixels);
+		return NULL;
+	}
+	memset(scaled.sums, 0, sums_len);
+
+	if (strips == 0) {
+		SLO_decode_scaled_rows(&scaled, p, scaled.job.chunks_len, 0, desc->height, scaled.sums);
+	}
+	else {
+		scaled.job.table = p - (size_t)strips * 8;
+		if (parallel) {
+			SLO_parallel_for_threads(strips, threads, SLO_decode_scaled_strip, &scaled);
+		}
+		else {
+			for (i = 0; i < strips; i++) {
+				SLO_decode_scaled_strip(&scaled, 0, i);
+			}
+		}
+	}
+
+	SLO_release(allocator, scaled.sums);
+	return scaled.job.pixels;
+}
+
+int SLO_measure_error(const void *data, size_t size, const void *pixels, unsigned char *max_error) {
+	return SLO_measure_error_impl(data, size, pixels, max_error, NULL);
+}
+
+int SLO_measure_stats(const void *data, size_t size, SLO_desc *desc, SLO_stats *stats) {
+	const unsigned char *bytes = (const unsigned char *)data;
+	const SLO_op_t *table;
+	size_t p, chunks_len;
+	int b1, op, long_index;
+
+	if (
+		data == NULL || desc == NULL || stats == NULL ||
+		size < SLO_HEADER_SIZE + sizeof(SLO_padding) ||
+		!SLO_read_header(bytes, size, desc, &p)
+	) {
+		return 0;
+	}
+	memset(stats, 0, sizeof(SLO_stats));
+	stats->header_bytes = p;
+
+	/* The strips follow each other without gaps, so their chunks can be
+	counted in one go */
+	chunks_len = size - sizeof(SLO_padding);
+	long_index = SLO_INDEX_SIZE(desc) > 64;
+	table = long_index ? SLO_op_table_long : SLO_op_table;
+	while (p < chunks_len) {
+		b1 = bytes[p];
+		if (b1 == SLO_OP_RGB) {
+			op = SLO_STAT_RGB;
+		}
+		else if (b1 == SLO_OP_RGBA) {
+			op = SLO_STAT_RGBA;
+		}
+		else if (SLO_IS_LONG(b1, long_index)) {
+			op = SLO_STAT_INDEX_LONG;
+		}
+		else if (SLO_IS_RUN(b1, long_index)) {
+			op = SLO_STAT_RUN;
+		}
+		else if (SLO_IS_INDEX(b1)) {
+			op = SLO_STAT_INDEX;
+		}
+		else if (SLO_IS_DIFF(b1)) {
+			op = SLO_STAT_DIFF;
+		}
+		else {
+			op = SLO_STAT_LUMA;
+		}
+
+		if (table[b1].len >= chunks_len - p) {
+			return 0;
+		}
+		stats->chunks[op]++;
+		stats->bytes[op] += 1 + table[b1].len;
+		stats->pixels[op] += 1 + table[b1].run;
+		p += 1 + table[b1].len;
+	}
+	return 1;
+}
+
+/* The streaming decoder keeps the input in dec->buffer, of which dec->pos bytes
+have been consumed. dec->offset is the file offset of the start of the buffer.
+Chunks are only decoded if they start at least 8 bytes before the end of the
+input seen so far, so that the end marker is never mistaken for chunks. */
+
+int SLO_decoder_init(SLO_decoder *dec, int channels) {
+	return SLO_decoder_init_ex(dec, channels, NULL);
+}
+
+int SLO_decoder_init_ex(SLO_decoder *dec, int channels, const SLO_allocator *allocator) {
+	if (dec == NULL) {
+		return 0;
+	}
+	memset(dec, 0, sizeof(SLO_decoder));
+	dec->allocator = allocator;
+	if (channels != 0 && channels != 3 && channels != 4) {
+		dec->error = 1;
+		return 0;
+	}
+	dec->channels = channels;
+	SLO_state_init(&dec->state, 64);
+	return 1;
+}
+
+void SLO_decoder_free(SLO_decoder *dec) {
+	if (dec == NULL) {
+		return;
+	}
+	SLO_release(dec->allocator, dec->row);
+	SLO_release(dec->allocator, dec->table);
+	dec->row = NULL;
+	dec->table = NULL;
+}
+
+static void SLO_decoder_compact(SLO_decoder *dec) {
+	int skip = dec->len - dec->pos;
+	if (dec->skip < (unsigned long long)skip) {
+		skip = (int)dec->skip;
+	}
+	dec->pos += skip;
+	dec->skip -= skip;
+
+	memmove(dec->buffer, dec->buffer + dec->pos, dec->len - dec->pos);
+	dec->offset += dec->pos;
+	dec->len -= dec->pos;
+	dec->pos = 0;
+}
+
+int SLO_decoder_feed(SLO_decoder *dec, const void *data, size_t size) {
+	size_t used = 0, n;
+
+	if (dec == NULL || dec->error || (data == NULL && size > 0)) {
+		return -1;
+	}
+	if (size == 0) {
+		dec->eof = 1;
+		return 0;
+	}
+
+	SLO_decoder_compact(dec);
+
+	/* Bytes between strips that are to be skipped never enter the buffer */
+	if (dec->len == 0 && dec->skip > 0) {
+		used = dec->skip < size ? (size_t)dec->skip : size;
+		dec->skip -= used;
+		dec->offset += used;
+		if (used == size) {
+			return (int)used;
+		}
+	}
+
+	n = SLO_DECODER_BUFFER - dec->len;
+	if (n > size - used) {
+		n = size - used;
+	}
+	memcpy(dec->buffer + dec->len, (const unsigned char *)data + used, n);
+	dec->len += (int)n;
+	return (int)(used + n);
+}
+
+/* Make room for one more strip table entry. The header alone could claim up to
+INT_MAX strips, so the table only grows with the entries that have actually
+been read, never past strips. */
+
+static int SLO_decoder_grow_table(SLO_decoder *dec, int strips) {
+	unsigned long long *table;
+	size_t cap;
+
+	if (dec->table_len < dec->table_cap) {
+		return 1;
+	}
+	cap = dec->table_cap ? (size_t)dec->table_cap * 2 : 64;
+	if (cap > (size_t)strips) {
+		cap = (size_t)strips;
+	}
+	if (cap > SLO_SIZE_MAX / sizeof(unsigned long long)) {
+		return 0;
+	}
+	table = (unsigned long long *) SLO_alloc(dec->allocator, cap * sizeof(unsigned long long));
+	if (!table) {
+		return 0;
+	}
+	if (dec->table_len > 0) {
+		memcpy(table, dec->table, (size_t)dec->table_len * sizeof(unsigned long long));
+	}
+	SLO_release(dec->allocator, dec->table);
+	dec->table = table;
+	dec->table_cap = (int)cap;
+	return 1;
+}
+
+/* Parse as much of the header and strip table as is available. Returns 1 once
+the header is complete. */
+
+static int SLO_decoder_header(SLO_decoder *dec) {
+	const unsigned char *bytes;
+	size_t p;
+	int size, strips;
+
+	if (dec->header) {
+		return 1;
+	}
+
+	bytes = dec->buffer + dec->pos;
+	if (dec->row == NULL) {
+		if (dec->len - dec->pos < SLO_HEADER_SIZE + 1) {
+			goto need_input;
+		}
+		size = SLO_desc_size(bytes);
+		if (dec->len - dec->pos < size) {
+			goto need_input;
+		}
+		if (!SLO_read_desc(bytes, &dec->desc, &p)) {
+			dec->error = 1;
+			return 0;
+		}
+		dec->pos += (int)p;
+
+		if (dec->channels == 0) {
+			dec->channels = dec->desc.channels;
+		}
+		if (dec->desc.width > SLO_SIZE_MAX / dec->channels) {
+			dec->error = 1;
+			return 0;
+		}
+
+		dec->row = (unsigned char *) SLO_alloc(dec->allocator, (size_t)dec->desc.width * dec->channels);
+		if (!dec->row) {
+			dec->error = 1;
+			return 0;
+		}
+	}
+
+	/* Strip offsets must lie behind the table and must not decrease */
+	strips = SLO_strip_count(&dec->desc);
+	while (dec->table_len < strips) {
+		unsigned long long prev, offset;
+
+		if (dec->len - dec->pos < 8) {
+			goto need_input;
+		}
+		p = dec->pos;
+		offset = SLO_read_64(dec->buffer, &p);
+		prev = dec->table_len > 0
+			? dec->table[dec->table_len - 1]
+			: dec->offset + dec->pos + (unsigned long long)strips * 8;
+		if (offset < prev || !SLO_decoder_grow_table(dec, strips)) {
+			dec->error = 1;
+			return 0;
+		}
+		dec->table[dec->table_len++] = offset;
+		dec->pos = (int)p;
+	}
+
+	SLO_state_init(&dec->state, SLO_INDEX_SIZE(&dec->desc));
+	dec->header = 1;
+	return 1;
+
+need_input:
+	if (dec->eof) {
+		dec->error = 1;
+	}
+	return 0;
+}
+
+/* Decode up to n pixels of the current strip into out. Returns fewer than n
+pixels only if more input is needed. */
+
+static int SLO_decoder_pixels(SLO_decoder *dec, SLO_rgba_t *out, int n) {
+	int end = dec->len - (int)sizeof(SLO_padding);
+	int strip_done = 0;
+	size_t p = dec->pos;
+	int got;
+
+	/* The strip's chunks end at the next strip's offset. Once that is in the
+	buffer (or already behind us) no further input is needed for it. */
+	if (dec->strip + 1 < dec->table_len) {
+		long long strip_end = (long long)(dec->table[dec->strip + 1] - dec->offset);
+		if (strip_end <= end || strip_end <= dec->pos) {
+			end = (int)strip_end;
+			strip_done = 1;
+		}
+	}
+
+	got = SLO_decode_pixels(&dec->state, dec->buffer, &p, end > 0 ? (size_t)end : 0, out, n);
+	dec->pos = (int)p;
+
+	/* If the chunks of the strip or the image run out early, the last pixel is
+	repeated */
+	if (got < n && (strip_done || dec->eof)) {
+		while (got < n) {
+			out[got++] = dec->state.px;
+		}
+	}
+	return got;
+}
+
+int SLO_decoder_read_rows(SLO_decoder *dec, void *out, int count, size_t stride) {
+	SLO_rgba_t batch[SLO_DECODE_BATCH];
+	SLO_rgba_t bias_row[SLO_BIAS_LEN];
+	const SLO_rgba_t *bias;
+	SLO_store_fn store;
+	unsigned char *dst = (unsigned char *)out;
+	size_t row_len;
+	int rows = 0;
+
+	if (dec == NULL || dec->error || count < 0 || (out == NULL && count > 0)) {
+		return -1;
+	}
+	if (!SLO_decoder_header(dec)) {
+		return dec->error ? -1 : 0;
+	}
+
+	store = SLO_store_kernel(&dec->desc, dec->channels);
+	row_len = (size_t)dec->desc.width * dec->channels;
+	if (stride == 0) {
+		stride = row_len;
+	}
+
+	while (rows < count && dec->rows < dec->desc.height) {
+		bias = SLO_recon_bias(bias_row, &dec->desc, dec->rows);
+		while (dec->x < dec->desc.width) {
+			int n = SLO_DECODE_BATCH;
+			int got;
+			if (dec->desc.width - dec->x < SLO_DECODE_BATCH) {
+				n = dec->desc.width - dec->x;
+			}
+			got = SLO_decoder_pixels(dec, batch, n);
+			store(
+				dec->row + (size_t)dec->x * dec->channels, batch, got,
+				SLO_LEVEL(&dec->desc), SLO_BIAS_TAIL(bias, dec->x & 3)
+			);
+			dec->x += got;
+			if (got < n) {
+				return rows;
+			}
+		}
+
+		memcpy(dst, dec->row, row_len);
+		dst += stride;
+		rows++;
+		dec->rows++;
+		dec->x = 0;
+
+		/* Move on to the next strip: reset the state and skip whatever is left
+		of the current strip's chunks */
+		if (
+			dec->table_len > 0 && dec->rows < dec->desc.height &&
+			dec->rows % dec->desc.strip_height == 0
+		) {
+			unsigned long long next = dec->table[++dec->strip];
+			unsigned long long here = dec->offset + dec->pos;
+			if (next < here) {
+				dec->error = 1;
+				return -1;
+			}
+			dec->skip = next - here;
+			SLO_decoder_compact(dec);
+			SLO_state_init(&dec->state, SLO_INDEX_SIZE(&dec->desc));
+		}
+	}
+
+	return rows;
 }
 
 #ifndef SLO_NO_STDIO
 #include <stdio.h>
 
+#if !defined(SLO_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+	#define SLO_MMAP
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+#define SLO_READ_CHUNK 65536
+
 int SLO_write(const char *filename, const void *data, const SLO_desc *desc) {
 	FILE *f = fopen(filename, "wb");
-	int size;
+	size_t size, written;
 	void *encoded;
 
 	if (!f) {
 		return 0;
 	}
 
-	encoded = SLO_encode(data, desc, &size);
+	encoded = SLO_encode64(data, desc, &size);
 	if (!encoded) {
 		fclose(f);
 		return 0;
 	}
 
-	fwrite(encoded, 1, size, f);
+	written = fwrite(encoded, 1, size, f);
 	fclose(f);
 
 	SLO_FREE(encoded);
-	return size;
+	if (written != size) {
+		return 0;
+	}
+	return size > INT_MAX ? INT_MAX : (int)size;
 }
 
-void *SLO_read(const char *filename, SLO_desc *desc, int channels) {
-	FILE *f = fopen(filename, "rb");
-	int size, bytes_read;
-	void *pixels, *data;
+/* Decode the file through the streaming decoder, allocating the output as soon
+as the header is known */
 
-	if (!f) {
+static void *SLO_read_stream(FILE *f, SLO_desc *desc, int channels) {
+	SLO_decoder dec;
+	unsigned char *chunk, *pixels = NULL;
+	size_t len, used, row_len = 0;
+	int n, count;
+
+	chunk = (unsigned char *) SLO_MALLOC(SLO_READ_CHUNK);
+	if (!chunk || !SLO_decoder_init(&dec, channels)) {
+		SLO_FREE(chunk);
 		return NULL;
 	}
 
-	fseek(f, 0, SEEK_END);
-	size = ftell(f);
-	if (size <= 0) {
-		fclose(f);
+	do {
+		len = fread(chunk, 1, SLO_READ_CHUNK, f);
+		used = 0;
+		do {
+			n = SLO_decoder_feed(&dec, chunk + used, len - used);
+			if (n < 0) {
+				goto fail;
+			}
+			used += n;
+
+			if (!pixels) {
+				if (SLO_decoder_read_rows(&dec, NULL, 0, 0) < 0) {
+					goto fail;
+				}
+				if (!dec.header) {
+					continue;
+				}
+				row_len = (size_t)dec.desc.width * dec.channels;
+				pixels = (unsigned char *) SLO_MALLOC(SLO_image_size(&dec.desc, dec.channels));
+				if (!pixels) {
+					goto fail;
+				}
+			}
+
+			/* The row count is an int, so taller images are read in pieces */
+			do {
+				count = dec.desc.height - dec.rows < INT_MAX ? (int)(dec.desc.height - dec.rows) : INT_MAX;
+				n = SLO_decoder_read_rows(&dec, pixels + dec.rows * row_len, count, 0);
+				if (n < 0) {
+					goto fail;
+				}
+			} while (n == count && dec.rows < dec.desc.height);
+		} while (used < len);
+	} while (len > 0 && (!pixels || dec.rows < dec.desc.height));
+
+	if (!pixels || dec.rows < dec.desc.height) {
+		goto fail;
+	}
+
+	*desc = dec.desc;
+	SLO_decoder_free(&dec);
+	SLO_FREE(chunk);
+	return pixels;
+
+fail:
+	SLO_decoder_free(&dec);
+	SLO_FREE(chunk);
+	SLO_FREE(pixels);
+	return NULL;
+}
+
+void *SLO_read(const char *filename, SLO_desc *desc, int channels) {
+	FILE *f;
+	void *pixels;
+
+#ifdef SLO_MMAP
+	struct stat st;
+	void *data;
+	int fd = open(filename, O_RDONLY);
+
+	if (fd < 0) {
 		return NULL;
 	}
-	fseek(f, 0, SEEK_SET);
 
-	data = SLO_MALLOC(size);
-	if (!data) {
-		fclose(f);
+	/* Anything but a non-empty regular file is read through stdio */
+	if (
+		fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+		(unsigned long long)st.st_size <= SLO_SIZE_MAX
+	) {
+		data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			close(fd);
+			#ifdef POSIX_MADV_SEQUENTIAL
+				posix_madvise(data, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+			#endif
+			pixels = SLO_decode64(data, (size_t)st.st_size, desc, channels);
+			munmap(data, (size_t)st.st_size);
+			return pixels;
+		}
+	}
+	close(fd);
+#endif
+
+	f = fopen(filename, "rb");
+	if (!f) {
 		return NULL;
 	}
 
-	bytes_read = fread(data, 1, size, f);
+	pixels = SLO_read_stream(f, desc, channels);
 	fclose(f);
-
-	pixels = SLO_decode(data, bytes_read, desc, channels);
-	SLO_FREE(data);
 	return pixels;
 }
 
@@ -0,0 +1,1476 @@
+/*
+
+Benchmark for SLO encode/decode throughput
+
+Walks the given directories (recursively) and PNG files, and encodes and decodes
+every image a number of times with SLO and, as a baseline, with stb_image and
+stb_image_write. Reports the median and 90th percentile run times, the
+throughput in megapixels per second and the compressed size in bytes per pixel,
+per image and per command line argument. Optionally writes all results as JSON.
+
+SLO is timed twice: as "slo" the en- and decoder write into buffers that are
+allocated once per image (SLO_encode_into, and the decoder loop into a buffer
+like SLO_decode_into), as "slo-alloc" through SLO_encode64 and SLO_decode64,
+which allocate their output on every run. With -l the decoder is also timed
+with the if/else opcode ladder that the table driven SLO decoder replaced, the
+same way as "slo", to compare the two.
+
+With --conformance no files are read. Instead, a set of generated edge case
+images (single pixels, trailing runs around the longest run chunk, alpha ramps,
+...) is encoded with every combination of settings, and all en- and decoders,
+SIMD, threaded and streaming, are checked bit for bit against each other and
+against the opcode ladder as a reference decoder. Exits with 1 if any check
+fails.
+
+Requires:
+	-"stb_image.h" (https://github.com/nothings/stb/blob/master/stb_image.h)
+	-"stb_image_write.h" (https://github.com/nothings/stb/blob/master/stb_image_write.h)
+	-"slo.h" (https://github.com/skandau/SLO.h)
+	-dirent.h (POSIX, or a port of it on Windows)
+
+Compile with:
+	gcc slobench.c -std=c99 -O3 -pthread -o slobench
+
+-- LICENSE: MIT License
+
+Based on QOI Copyright(c) 2021 Dominic Szablewski
+SLO release 2022 surya kandau
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+
+#define _POSIX_C_SOURCE 199309L
+
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_PNG
+#define STBI_NO_LINEAR
+#include "stb_image.h"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+#define SLO_IMPLEMENTATION
+#include "slo.h"
+
+#include <stdio.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <time.h>
+#endif
+
+
+#define STR_ENDS_WITH(S, E) (strlen(S) >= sizeof(E)-1 && strcmp(S + strlen(S) - (sizeof(E)-1), E) == 0)
+
+#define BENCH_STB       0
+#define BENCH_SLO       1
+#define BENCH_SLO_ALLOC 2
+#define BENCH_LADDER    3
+#define BENCH_LIBS      4
+
+static const char *bench_lib_names[BENCH_LIBS] = {"stbi", "slo", "slo-alloc", "slo-ladder"};
+
+typedef struct {
+	int runs;
+	int no_stb;
+	int ladder;
+	int quiet;
+	FILE *json;
+} bench_opts_t;
+
+/* Results of one library on one image. Times are in seconds. */
+
+typedef struct {
+	int ok;
+	size_t size;
+	double encode_p50, encode_p90;
+	double decode_p50, decode_p90;
+} bench_result_t;
+
+typedef struct {
+	char *path;
+	int width, height, channels;
+	bench_result_t lib[BENCH_LIBS];
+} bench_image_t;
+
+typedef struct {
+	bench_image_t *images;
+	int len, capacity;
+} bench_group_t;
+
+
+static double bench_time(void) {
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+static int bench_compare_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest rank percentile; sorts the values */
+
+static double bench_percentile(double *values, int len, double pct) {
+	int rank;
+	if (len == 0) {
+		return 0;
+	}
+	qsort(values, len, sizeof(double), bench_compare_double);
+	rank = (int)(pct / 100.0 * len + 0.999999);
+	if (rank < 1) {
+		rank = 1;
+	}
+	return values[rank > len ? len - 1 : rank - 1];
+}
+
+static double bench_mps(double pixels, double seconds) {
+	return seconds > 0 ? pixels / seconds / 1e6 : 0;
+}
+
+static void *bench_read_file(const char *path, int *size) {
+	FILE *f = fopen(path, "rb");
+	long len;
+	void *data;
+
+	if (!f) {
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (len <= 0 || len > INT_MAX) {
+		fclose(f);
+		return NULL;
+	}
+	data = malloc(len);
+	if (data && fread(data, 1, len, f) != (size_t)len) {
+		free(data);
+		data = NULL;
+	}
+	fclose(f);
+	*size = (int)len;
+	return data;
+}
+
+
+/* The decoder as it was before the opcode table: tests the tag against RGB and
+RGBA first, then masks it for each of the other four ops. Kept here as the
+reference the table driven SLO_decode_pixels is measured against, and that the
+conformance check decodes with. */
+
+static int ladder_decode_pixels(SLO_state *state, const unsigned char *bytes, size_t *pp, size_t end, SLO_rgba_t *out, int n) {
+	SLO_rgba_t *index = state->index;
+	SLO_rgba_t *index_long = state->index_long;
+	SLO_rgba_t px = state->px;
+	int run = state->run;
+	int long_mask = state->long_mask;
+	size_t p = *pp;
+	int i = 0, b1;
+	unsigned int hash;
+
+	while (i < n) {
+		if (run > 0) {
+			int k = run < n - i ? run : n - i;
+			run -= k;
+			while (k--) {
+				out[i++] = px;
+			}
+			continue;
+		}
+
+		if (p >= end) {
+			break;
+		}
+
+		b1 = bytes[p++];
+
+		if (b1 == SLO_OP_RGB) {
+			px.rgba.r = bytes[p++];
+			px.rgba.g = bytes[p++];
+			px.rgba.b = bytes[p++];
+		}
+		else if (b1 == SLO_OP_RGBA) {
+			px.rgba.r = bytes[p++];
+			px.rgba.g = bytes[p++];
+			px.rgba.b = bytes[p++];
+			px.rgba.a = bytes[p++];
+		}
+		else if ((b1 & SLO_MASK_2) == SLO_OP_INDEX) {
+			px = index[b1];
+		}
+		else if ((b1 & SLO_MASK_2) == SLO_OP_DIFF) {
+			px.rgba.r += ((b1 >> 4) & 0x03) - 2;
+			px.rgba.g += ((b1 >> 2) & 0x03) - 2;
+			px.rgba.b += ( b1       & 0x03) - 2;
+		}
+		else if ((b1 & SLO_MASK_2) == SLO_OP_LUMA) {
+			int b2 = bytes[p++];
+			int vg = (b1 & 0x3f) - 32;
+			px.rgba.r += vg - 8 + ((b2 >> 4) & 0x0f);
+			px.rgba.g += vg;
+			px.rgba.b += vg - 8 +  (b2       & 0x0f);
+		}
+		else if ((b1 & SLO_MASK_2) == SLO_OP_RUN) {
+			if (long_mask && b1 >= SLO_OP_INDEX_LONG) {
+				px = index_long[((b1 << 8) | bytes[p++]) & long_mask];
+			}
+			else {
+				run = (b1 & 0x3f);
+			}
+		}
+
+		hash = SLO_COLOR_HASH(px);
+		index[hash % 64] = px;
+		index_long[hash & long_mask] = px;
+		out[i++] = px;
+	}
+
+	state->px = px;
+	state->run = run;
+	*pp = p;
+	return i;
+}
+
+typedef int (*bench_engine_fn)(SLO_state *state, const unsigned char *bytes, size_t *pp, size_t end, SLO_rgba_t *out, int n);
+
+/* Decode an unstriped SLO image with the given engine. This is the loop of
+SLO_decode_chunks, with the engine passed in. */
+
+static void bench_decode_engine(bench_engine_fn engine, const unsigned char *bytes, size_t size, unsigned char *pixels) {
+	SLO_rgba_t batch[SLO_DECODE_BATCH];
+	SLO_state state;
+	SLO_desc desc;
+	SLO_store_fn store;
+	size_t p = 0, px_pos, px_count, end = size - sizeof(SLO_padding);
+	int batch_len, n;
+
+	SLO_read_header(bytes, size, &desc, &p);
+	store = SLO_store_kernel(&desc, desc.channels);
+	px_count = (size_t)desc.width * desc.height;
+	SLO_state_init(&state, SLO_INDEX_SIZE(&desc));
+
+	for (px_pos = 0; px_pos < px_count; px_pos += batch_len) {
+		batch_len = SLO_DECODE_BATCH;
+		if (px_count - px_pos < SLO_DECODE_BATCH) {
+			batch_len = (int)(px_count - px_pos);
+		}
+
+		n = engine(&state, bytes, &p, end, batch, batch_len);
+		while (n < batch_len) {
+			batch[n++] = state.px;
+		}
+
+		store(pixels + px_pos * desc.channels, batch, batch_len, SLO_LEVEL(&desc), NULL);
+	}
+}
+
+
+/* Run all libraries on one image, opts->runs times each */
+
+static int bench_image(const char *path, const bench_opts_t *opts, bench_image_t *img) {
+	SLO_desc desc, out_desc;
+	unsigned char *png, *pixels, *encoded, *ref, *decoded, *encode_buf;
+	double *encode_t, *decode_t, t;
+	size_t size, run_size, px_len, bound;
+	int png_size, w, h, channels, lib, run, len;
+	void *out;
+
+	png = (unsigned char *)bench_read_file(path, &png_size);
+	if (!png || !stbi_info_from_memory(png, png_size, &w, &h, &channels)) {
+		free(png);
+		return 0;
+	}
+
+	/* Force all odd encodings to be RGBA */
+	if (channels != 3) {
+		channels = 4;
+	}
+
+	pixels = stbi_load_from_memory(png, png_size, &w, &h, NULL, channels);
+	if (!pixels) {
+		free(png);
+		return 0;
+	}
+
+	memset(&desc, 0, sizeof(desc));
+	desc.width = w;
+	desc.height = h;
+	desc.channels = channels;
+	desc.colorspace = SLO_SRGB;
+
+	/* The encoded image and its decoded pixels, as input and reference for the
+	timed runs */
+	px_len = (size_t)w * h * channels;
+	encoded = (unsigned char *)SLO_encode64(pixels, &desc, &size);
+	ref = encoded ? (unsigned char *)SLO_decode64(encoded, size, &out_desc, channels) : NULL;
+	bound = SLO_encode_bound(&desc);
+	decoded = (unsigned char *)malloc(px_len);
+	encode_buf = (unsigned char *)malloc(bound);
+	encode_t = (double *)malloc(opts->runs * sizeof(double));
+	decode_t = (double *)malloc(opts->runs * sizeof(double));
+	if (!ref || !decoded || !encode_buf || !encode_t || !decode_t) {
+		printf("Couldn't encode %s\n", path);
+		exit(1);
+	}
+
+	memset(img, 0, sizeof(bench_image_t));
+	img->width = w;
+	img->height = h;
+	img->channels = channels;
+
+	for (lib = 0; lib < BENCH_LIBS; lib++) {
+		bench_result_t *res = &img->lib[lib];
+		if (
+			(lib == BENCH_STB && opts->no_stb) ||
+			(lib == BENCH_LADDER && !opts->ladder)
+		) {
+			continue;
+		}
+
+		for (run = 0; run < opts->runs; run++) {
+			if (lib == BENCH_STB) {
+				t = bench_time();
+				out = stbi_write_png_to_mem(pixels, 0, w, h, channels, &len);
+				encode_t[run] = bench_time() - t;
+				res->size = len;
+				free(out);
+
+				t = bench_time();
+				out = stbi_load_from_memory(png, png_size, &w, &h, NULL, channels);
+				decode_t[run] = bench_time() - t;
+				free(out);
+			}
+			else if (lib == BENCH_SLO) {
+				t = bench_time();
+				run_size = SLO_encode_into(pixels, &desc, encode_buf, bound);
+				encode_t[run] = bench_time() - t;
+				if (run_size != size || memcmp(encode_buf, encoded, size) != 0) {
+					printf("Encoders disagree on %s\n", path);
+					exit(1);
+				}
+				res->size = size;
+
+				t = bench_time();
+				bench_decode_engine(SLO_decode_pixels, encoded, size, decoded);
+				decode_t[run] = bench_time() - t;
+				if (memcmp(decoded, ref, px_len) != 0) {
+					printf("Decoders disagree on %s\n", path);
+					exit(1);
+				}
+			}
+			else if (lib == BENCH_SLO_ALLOC) {
+				t = bench_time();
+				out = SLO_encode64(pixels, &desc, &run_size);
+				encode_t[run] = bench_time() - t;
+				if (!out || run_size != size) {
+					printf("Couldn't encode %s\n", path);
+					exit(1);
+				}
+				res->size = size;
+				free(out);
+
+				t = bench_time();
+				out = SLO_decode64(encoded, size, &out_desc, channels);
+				decode_t[run] = bench_time() - t;
+				if (!out) {
+					printf("Couldn't decode %s\n", path);
+					exit(1);
+				}
+				free(out);
+			}
+			else {
+				/* The ladder only replaces the decoder */
+				encode_t[run] = 0;
+				res->size = size;
+
+				t = bench_time();
+				bench_decode_engine(ladder_decode_pixels, encoded, size, decoded);
+				decode_t[run] = bench_time() - t;
+				if (memcmp(decoded, ref, px_len) != 0) {
+					printf("Decoders disagree on %s\n", path);
+					exit(1);
+				}
+			}
+		}
+
+		res->ok = 1;
+		res->encode_p50 = bench_percentile(encode_t, opts->runs, 50);
+		res->encode_p90 = bench_percentile(encode_t, opts->runs, 90);
+		res->decode_p50 = bench_percentile(decode_t, opts->runs, 50);
+		res->decode_p90 = bench_percentile(decode_t, opts->runs, 90);
+	}
+
+	free(decode_t);
+	free(encode_t);
+	free(encode_buf);
+	free(decoded);
+	free(ref);
+	free(encoded);
+	free(pixels);
+	free(png);
+	return 1;
+}
+
+
+static void bench_print_image(const bench_image_t *img, const char *path) {
+	double px = (double)img->width * img->height;
+	int lib;
+
+	printf("## %s size: %dx%d\n", path, img->width, img->height);
+	for (lib = 0; lib < BENCH_LIBS; lib++) {
+		const bench_result_t *res = &img->lib[lib];
+		if (!res->ok) {
+			continue;
+		}
+		printf(
+			"%-12s %10.3f %10.3f %10.3f %10.3f %10.2f %10.2f %8.3f\n",
+			bench_lib_names[lib],
+			res->decode_p50 * 1000, res->decode_p90 * 1000,
+			res->encode_p50 * 1000, res->encode_p90 * 1000,
+			bench_mps(px, res->decode_p50), bench_mps(px, res->encode_p50),
+			res->size / px
+		);
+	}
+	printf("\n");
+}
+
+/* Summary of one library over a group of images: the totals, and percentiles
+of the per image throughput (p10 are the slow images) */
+
+typedef struct {
+	int images;
+	double px, size;
+	double encode_t, decode_t;
+	double encode_mps[3], decode_mps[3];
+} bench_summary_t;
+
+static bench_summary_t bench_summarize(const bench_group_t *group, int lib) {
+	static const double pct[3] = {10, 50, 90};
+	bench_summary_t sum;
+	double *enc, *dec;
+	int i, n = 0;
+
+	memset(&sum, 0, sizeof(sum));
+	enc = (double *)malloc((group->len + 1) * sizeof(double));
+	dec = (double *)malloc((group->len + 1) * sizeof(double));
+	if (!enc || !dec) {
+		puts("Out of memory");
+		exit(1);
+	}
+
+	for (i = 0; i < group->len; i++) {
+		const bench_image_t *img = &group->images[i];
+		const bench_result_t *res = &img->lib[lib];
+		double px = (double)img->width * img->height;
+		if (!res->ok) {
+			continue;
+		}
+		sum.px += px;
+		sum.size += res->size;
+		sum.encode_t += res->encode_p50;
+		sum.decode_t += res->decode_p50;
+		enc[n] = bench_mps(px, res->encode_p50);
+		dec[n] = bench_mps(px, res->decode_p50);
+		n++;
+	}
+
+	sum.images = n;
+	for (i = 0; i < 3; i++) {
+		sum.encode_mps[i] = bench_percentile(enc, n, pct[i]);
+		sum.decode_mps[i] = bench_percentile(dec, n, pct[i]);
+	}
+	free(dec);
+	free(enc);
+	return sum;
+}
+
+static void bench_print_group(const bench_group_t *group, const char *path) {
+	int lib;
+
+	printf("## Total for %s (%d images)\n", path, group->len);
+	printf(
+		"%-12s %10s %10s %10s %10s %10s %10s %8s\n",
+		"", "dec mpps", "dec p10", "dec p90", "enc mpps", "enc p10", "enc p90", "bytes/px"
+	);
+	for (lib = 0; lib < BENCH_LIBS; lib++) {
+		bench_summary_t sum = bench_summarize(group, lib);
+		if (sum.images == 0) {
+			continue;
+		}
+		printf(
+			"%-12s %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f %8.3f\n",
+			bench_lib_names[lib],
+			bench_mps(sum.px, sum.decode_t), sum.decode_mps[0], sum.decode_mps[2],
+			bench_mps(sum.px, sum.encode_t), sum.encode_mps[0], sum.encode_mps[2],
+			sum.size / sum.px
+		);
+	}
+	printf("\n");
+}
+
+
+static void bench_json_string(FILE *f, const char *s) {
+	fputc('"', f);
+	for (; *s; s++) {
+		unsigned char c = (unsigned char)*s;
+		if (c == '"' || c == '\\') {
+			fprintf(f, "\\%c", c);
+		}
+		else if (c < 0x20) {
+			fprintf(f, "\\u%04x", c);
+		}
+		else {
+			fputc(c, f);
+		}
+	}
+	fputc('"', f);
+}
+
+static void bench_json_group(FILE *f, const bench_group_t *group, const char *path, int first) {
+	int i, lib;
+
+	for (i = 0; i < group->len; i++) {
+		const bench_image_t *img = &group->images[i];
+		double px = (double)img->width * img->height;
+
+		fprintf(f, "%s\n\t\t{\"group\": ", first && i == 0 ? "" : ",");
+		bench_json_string(f, path);
+		fprintf(f, ", \"path\": ");
+		bench_json_string(f, img->path);
+		fprintf(
+			f, ", \"width\": %d, \"height\": %d, \"channels\": %d",
+			img->width, img->height, img->channels
+		);
+		for (lib = 0; lib < BENCH_LIBS; lib++) {
+			const bench_result_t *res = &img->lib[lib];
+			if (!res->ok) {
+				continue;
+			}
+			fprintf(
+				f,
+				",\n\t\t\t\"%s\": {\"bytes\": %zu, \"bytes_per_pixel\": %.6f, "
+				"\"decode_ms_p50\": %.6f, \"decode_ms_p90\": %.6f, "
+				"\"encode_ms_p50\": %.6f, \"encode_ms_p90\": %.6f, "
+				"\"decode_mps\": %.3f, \"encode_mps\": %.3f}",
+				bench_lib_names[lib], res->size, res->size / px,
+				res->decode_p50 * 1000, res->decode_p90 * 1000,
+				res->encode_p50 * 1000, res->encode_p90 * 1000,
+				bench_mps(px, res->decode_p50), bench_mps(px, res->encode_p50)
+			);
+		}
+		fprintf(f, "}");
+	}
+}
+
+static void bench_json_summary(FILE *f, const bench_group_t *group, const char *path, int first) {
+	int lib;
+
+	fprintf(f, "%s\n\t\t{\"path\": ", first ? "" : ",");
+	bench_json_string(f, path);
+	fprintf(f, ", \"images\": %d", group->len);
+	for (lib = 0; lib < BENCH_LIBS; lib++) {
+		bench_summary_t sum = bench_summarize(group, lib);
+		if (sum.images == 0) {
+			continue;
+		}
+		fprintf(
+			f,
+			",\n\t\t\t\"%s\": {\"bytes_per_pixel\": %.6f, "
+			"\"decode_mps\": %.3f, \"decode_mps_p10\": %.3f, \"decode_mps_p50\": %.3f, \"decode_mps_p90\": %.3f, "
+			"\"encode_mps\": %.3f, \"encode_mps_p10\": %.3f, \"encode_mps_p50\": %.3f, \"encode_mps_p90\": %.3f}",
+			bench_lib_names[lib], sum.size / sum.px,
+			bench_mps(sum.px, sum.decode_t), sum.decode_mps[0], sum.decode_mps[1], sum.decode_mps[2],
+			bench_mps(sum.px, sum.encode_t), sum.encode_mps[0], sum.encode_mps[1], sum.encode_mps[2]
+		);
+	}
+	fprintf(f, "}");
+}
+
+
+/* Benchmark a PNG file, or all PNG files below a directory, into group */
+
+static void bench_path(const char *path, const bench_opts_t *opts, bench_group_t *group) {
+	struct stat st;
+	bench_image_t img;
+
+	if (stat(path, &st) != 0) {
+		printf("Couldn't open %s\n", path);
+		return;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		DIR *dir = opendir(path);
+		struct dirent *entry;
+		if (!dir) {
+			printf("Couldn't open directory %s\n", path);
+			return;
+		}
+		while ((entry = readdir(dir)) != NULL) {
+			size_t len = strlen(path) + strlen(entry->d_name) + 2;
+			char *child;
+			if (entry->d_name[0] == '.') {
+				continue;
+			}
+			child = (char *)malloc(len);
+			if (!child) {
+				puts("Out of memory");
+				exit(1);
+			}
+			snprintf(child, len, "%s/%s", path, entry->d_name);
+			if (stat(child, &st) == 0 && (S_ISDIR(st.st_mode) || STR_ENDS_WITH(child, ".png"))) {
+				bench_path(child, opts, group);
+			}
+			free(child);
+		}
+		closedir(dir);
+		return;
+	}
+
+	if (!bench_image(path, opts, &img)) {
+		printf("Couldn't load %s\n", path);
+		return;
+	}
+
+	img.path = (char *)malloc(strlen(path) + 1);
+	if (group->len == group->capacity) {
+		group->capacity = group->capacity ? group->capacity * 2 : 64;
+		group->images = (bench_image_t *)realloc(group->images, group->capacity * sizeof(bench_image_t));
+	}
+	if (!img.path || !group->images) {
+		puts("Out of memory");
+		exit(1);
+	}
+	strcpy(img.path, path);
+	group->images[group->len++] = img;
+
+	if (!opts->quiet) {
+		bench_print_image(&img, path);
+	}
+}
+
+/* Conformance check (--conformance). Every generated edge case image is
+encoded with each combination of channels, quality, recon, index size, strip
+height and near match mode, then checked:
+ - the chunks of the image, or of each strip, cover exactly its pixels: no run
+   goes past the last pixel and no bytes are left before the next strip or the
+   end marker
+ - the pixels decode to the quantized input, unless the encoder took near
+   matches, in which case at least alpha must be exact
+ - SLO_encode, SLO_encode_parallel, SLO_encode_into and the streaming encoder
+   write the same bytes
+ - SLO_decode, SLO_decode_parallel, SLO_decode_into, the streaming decoder and
+   SLO_measure_error agree with the reference decoder: ladder_decode_pixels and
+   the dequantization as the format description in slo.h spells it out
+ - SLO_measure_stats accounts for every byte and every pixel
+ - SLO_decode_region gives the same pixels as a crop of the whole image, for
+   the whole image, its first row, last pixel and a rectangle in the middle
+ - SLO_decode_scaled gives the box filtered reference pixels at every scale
+ - SLO_encode_ex and SLO_decode_ex give the same results with an arena and a
+   pool allocator, and give all pool blocks back */
+
+#define CONF_IMAGES 32
+
+typedef struct {
+	char name[32];
+	int width, height;
+	unsigned char *rgba;
+} conf_image_t;
+
+typedef struct {
+	int checks;
+	int failed;
+} conf_result_t;
+
+static void *conf_alloc(size_t size) {
+	void *p = malloc(size ? size : 1);
+	if (!p) {
+		puts("Out of memory");
+		exit(1);
+	}
+	return p;
+}
+
+static unsigned int conf_rand(unsigned int *seed) {
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 16;
+}
+
+static void conf_fill(unsigned char *px, int count, int r, int g, int b, int a) {
+	for (; count > 0; count--, px += 4) {
+		px[0] = r;
+		px[1] = g;
+		px[2] = b;
+		px[3] = a;
+	}
+}
+
+static unsigned char *conf_add(conf_image_t *images, int *len, const char *name, int width, int height) {
+	conf_image_t *img = &images[(*len)++];
+	snprintf(img->name, sizeof(img->name), "%s", name);
+	img->width = width;
+	img->height = height;
+	img->rgba = (unsigned char *)conf_alloc((size_t)width * height * 4);
+	return img->rgba;
+}
+
+/* Generate the images to check. Returns the number of images. */
+
+static int conf_corpus(conf_image_t *images) {
+	static const int runs[] = {1, 2, 57, 58, 59, 61, 62, 63, 64, 116, 124, 125};
+	static const unsigned char alphas[] = {2, 4, 8, 16, 32, 64, 128};
+	unsigned char palette[300][4];
+	unsigned int seed = 1;
+	unsigned char *px;
+	char name[32];
+	int len = 0, i, x, y;
+
+	/* A single pixel, once the same as the initial previous pixel, so that the
+	whole image is a run */
+	px = conf_add(images, &len, "single-initial", 1, 1);
+	conf_fill(px, 1, 0, 0, 0, 255);
+	px = conf_add(images, &len, "single", 1, 1);
+	conf_fill(px, 1, 200, 100, 50, 128);
+
+	px = conf_add(images, &len, "same-initial", 64, 64);
+	conf_fill(px, 64 * 64, 0, 0, 0, 255);
+	px = conf_add(images, &len, "same", 37, 29);
+	conf_fill(px, 37 * 29, 10, 20, 30, 255);
+
+	/* One pixel and a trailing run, around the longest run chunk with and
+	without a long index (62 and 58) and twice that */
+	for (i = 0; i < (int)(sizeof(runs) / sizeof(runs[0])); i++) {
+		snprintf(name, sizeof(name), "run-%d", runs[i]);
+		px = conf_add(images, &len, name, runs[i] + 1, 1);
+		conf_fill(px, 1, 255, 0, 0, 255);
+		conf_fill(px + 4, runs[i], 9, 9, 9, 255);
+	}
+
+	/* Every row, and so every strip, ends in a run */
+	px = conf_add(images, &len, "row-runs", 67, 9);
+	for (y = 0; y < 9; y++) {
+		for (x = 0; x < 67; x++, px += 4) {
+			if (x < y * 7) {
+				conf_fill(px, 1, conf_rand(&seed) & 0xff, conf_rand(&seed) & 0xff, 7, 255);
+			}
+			else {
+				conf_fill(px, 1, y * 20, 255 - y * 20, 7, 255);
+			}
+		}
+	}
+
+	/* Alpha ramps over a constant color, then colors whose alpha values are
+	powers of two, so that many are twice or eight times each other */
+	px = conf_add(images, &len, "alpha-gradient", 256, 4);
+	for (y = 0; y < 4; y++) {
+		for (x = 0; x < 256; x++, px += 4) {
+			if (y == 0) {
+				conf_fill(px, 1, 100, 150, 200, x);
+			}
+			else if (y == 1) {
+				conf_fill(px, 1, 100, 150, 200, 255 - x);
+			}
+			else if (y == 2) {
+				conf_fill(px, 1, x, 150, 200, (x * 2) & 0xff);
+			}
+			else {
+				conf_fill(px, 1, conf_rand(&seed) & 3, 0, 0, alphas[conf_rand(&seed) % 7]);
+			}
+		}
+	}
+
+	px = conf_add(images, &len, "gradient", 61, 47);
+	for (y = 0; y < 47; y++) {
+		for (x = 0; x < 61; x++, px += 4) {
+			conf_fill(px, 1, x * 4, y * 5, (x + y) * 2, 255 - x);
+		}
+	}
+
+	px = conf_add(images, &len, "noise", 53, 41);
+	for (i = 0; i < 53 * 41 * 4; i++) {
+		px[i] = conf_rand(&seed) & 0xff;
+	}
+
+	/* More colors than the short index holds, with short runs */
+	for (i = 0; i < 300; i++) {
+		conf_fill(palette[i], 1, conf_rand(&seed) & 0xff, conf_rand(&seed) & 0xff, conf_rand(&seed) & 0xff, i % 3 ? 255 : 128);
+	}
+	px = conf_add(images, &len, "palette", 160, 96);
+	for (i = 0; i < 160 * 96; i++, px += 4) {
+		memcpy(px, i > 0 && conf_rand(&seed) % 4 == 0 ? px - 4 : palette[conf_rand(&seed) % 300], 4);
+	}
+
+	/* A width that leaves a tail for the SIMD kernels in every row */
+	px = conf_add(images, &len, "odd-tail", 13, 7);
+	for (i = 0; i < 13 * 7; i++, px += 4) {
+		x = conf_rand(&seed) % 3;
+		conf_fill(px, 1, x == 2 ? 200 : 1, 2, 3, x == 1 ? 254 : 255);
+	}
+
+	return len;
+}
+
+/* Decode bytes with ladder_decode_pixels into the quantized pixels q, checking
+that the chunks of each strip end with its last pixel, right where the next
+strip or the end marker starts. Returns NULL or what is wrong. */
+
+static const char *conf_ref_decode(const unsigned char *bytes, size_t size, SLO_desc *desc, SLO_rgba_t *q) {
+	SLO_state state;
+	size_t p, entry, next, end, chunks_len;
+	unsigned int y, rows;
+	int strips, i, n;
+
+	if (size < SLO_HEADER_SIZE + sizeof(SLO_padding) || !SLO_read_header(bytes, size, desc, &p)) {
+		return "invalid header";
+	}
+	chunks_len = size - sizeof(SLO_padding);
+	if (memcmp(bytes + chunks_len, SLO_padding, sizeof(SLO_padding)) != 0) {
+		return "no end marker";
+	}
+
+	strips = SLO_strip_count(desc);
+	entry = p - (size_t)strips * 8;
+	rows = strips ? desc->strip_height : desc->height;
+	for (i = 0, y = 0; y < desc->height; i++, y += rows) {
+		if (rows > desc->height - y) {
+			rows = desc->height - y;
+		}
+		if (strips) {
+			p = (size_t)SLO_read_64(bytes, &entry);
+		}
+		next = entry;
+		end = i + 1 < strips ? (size_t)SLO_read_64(bytes, &next) : chunks_len;
+
+		n = (int)(rows * desc->width);
+		SLO_state_init(&state, SLO_INDEX_SIZE(desc));
+		if (ladder_decode_pixels(&state, bytes, &p, end, q + (size_t)y * desc->width, n) < n) {
+			return "chunks end before the last pixel";
+		}
+		if (state.run > 0) {
+			return "run goes past the last pixel";
+		}
+		if (p != end) {
+			return "chunks left after the last pixel";
+		}
+	}
+	return NULL;
+}
+
+/* Restore the pixels as described under "Quantization" in slo.h */
+
+static void conf_dequant(const SLO_rgba_t *q, const SLO_desc *desc, unsigned char *pixels) {
+	static const unsigned char bayer[4][4] = {{0, 8, 2, 10}, {12, 4, 14, 6}, {3, 11, 1, 9}, {15, 7, 13, 5}};
+	const unsigned char *shift = SLO_shifts[SLO_LEVEL(desc)];
+	unsigned int x, y;
+	int t;
+
+	for (y = 0; y < desc->height; y++) {
+		for (x = 0; x < desc->width; x++, q++, pixels += desc->channels) {
+			t = 0;
+			if (desc->recon == SLO_RECON_MIDPOINT) {
+				t = 16;
+			}
+			else if (desc->recon == SLO_RECON_DITHER) {
+				t = bayer[y % 4][x % 4] * 2 + 1;
+			}
+			pixels[0] = (q->rgba.r << shift[0]) + ((t << shift[0]) >> 5);
+			pixels[1] = (q->rgba.g << shift[1]) + ((t << shift[1]) >> 5);
+			pixels[2] = (q->rgba.b << shift[2]) + ((t << shift[2]) >> 5);
+			if (desc->channels == 4) {
+				pixels[3] = q->rgba.a;
+			}
+		}
+	}
+}
+
+/* Whether q holds the quantized input pixels, or with near matches at least
+their alpha */
+
+static int conf_quantized(const unsigned char *pixels, const SLO_rgba_t *q, const SLO_desc *desc, size_t count) {
+	const unsigned char *shift = SLO_shifts[SLO_LEVEL(desc)];
+	int near = desc->tolerance > 0 || desc->bounded;
+	unsigned char round[3];
+	size_t i;
+
+	SLO_quant_round(desc, round);
+	for (i = 0; i < count; i++, q++, pixels += desc->channels) {
+		if (q->rgba.a != (desc->channels == 4 ? pixels[3] : 255)) {
+			return 0;
+		}
+		if (!near && (
+			q->rgba.r != SLO_QUANT(pixels[0], shift[0], round[0]) ||
+			q->rgba.g != SLO_QUANT(pixels[1], shift[1], round[1]) ||
+			q->rgba.b != SLO_QUANT(pixels[2], shift[2], round[2])
+		)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Decode with the streaming decoder, feeding a few bytes at a time */
+
+static int conf_stream_decode(const unsigned char *bytes, size_t size, unsigned char *pixels, size_t row_len) {
+	SLO_decoder *dec = (SLO_decoder *)conf_alloc(sizeof(SLO_decoder));
+	size_t pos = 0, piece;
+	int used, rows, done = 0;
+
+	SLO_decoder_init(dec, 0);
+	while (!done) {
+		piece = size - pos < 7 ? size - pos : 7;
+		used = SLO_decoder_feed(dec, bytes + pos, piece);
+		if (used < 0) {
+			break;
+		}
+		pos += used;
+		do {
+			rows = SLO_decoder_read_rows(dec, pixels + dec->rows * row_len, 1, 0);
+		} while (rows == 1);
+		done = dec->header && dec->rows == dec->desc.height;
+		if (rows < 0 || piece == 0) {
+			break;
+		}
+	}
+	SLO_decoder_free(dec);
+	free(dec);
+	return done;
+}
+
+static void conf_expect(conf_result_t *res, const conf_image_t *img, const SLO_desc *desc, int ok, const char *what) {
+	res->checks++;
+	if (!ok) {
+		res->failed++;
+		printf(
+			"FAIL %s c%d q%d r%d i%d s%u t%d b%d: %s\n", img->name, desc->channels, desc->quality,
+			desc->recon, desc->index_size, desc->strip_height, desc->tolerance, desc->bounded, what
+		);
+	}
+}
+
+static int conf_pool_blocks(const SLO_pool *pool) {
+	void *block = pool->free_list;
+	int n;
+	for (n = 0; block; n++) {
+		memcpy(&block, block, sizeof(void *));
+	}
+	return n;
+}
+
+/* Shrink ref by scale with a box filter, the straightforward way, and compare
+it to SLO_decode_scaled */
+
+static void conf_check_scaled(
+	const conf_image_t *img, const SLO_desc *desc, conf_result_t *res,
+	const unsigned char *bytes, size_t len, const unsigned char *ref, int scale
+) {
+	int out_w = (img->width + scale - 1) / scale, out_h = (img->height + scale - 1) / scale;
+	int ch = desc->channels, ok, ox, oy, k, x, y, count;
+	unsigned int sum;
+	unsigned char *scaled;
+	SLO_desc d;
+
+	scaled = (unsigned char *)SLO_decode_scaled(bytes, len, &d, 0, scale, 4);
+	ok = scaled != NULL;
+	for (oy = 0; ok && oy < out_h; oy++) {
+		for (ox = 0; ok && ox < out_w; ox++) {
+			for (k = 0; ok && k < ch; k++) {
+				sum = count = 0;
+				for (y = oy * scale; y < oy * scale + scale && y < img->height; y++) {
+					for (x = ox * scale; x < ox * scale + scale && x < img->width; x++, count++) {
+						sum += ref[((size_t)y * img->width + x) * ch + k];
+					}
+				}
+				ok = scaled[((size_t)oy * out_w + ox) * ch + k] == (sum + count / 2) / count;
+			}
+		}
+	}
+	conf_expect(res, img, desc, ok, scale == 1 ? "SLO_decode_scaled by 1 differs" : "SLO_decode_scaled differs");
+	free(scaled);
+}
+
+static void conf_check_region(
+	const conf_image_t *img, const SLO_desc *desc, conf_result_t *res,
+	const unsigned char *bytes, size_t len, const unsigned char *ref,
+	int x, int y, int w, int h
+) {
+	size_t row_len = (size_t)w * desc->channels;
+	unsigned char *region;
+	SLO_desc d;
+	int ok, k;
+
+	region = (unsigned char *)SLO_decode_region(bytes, len, &d, 0, x, y, w, h, 4);
+	ok = region != NULL;
+	for (k = 0; ok && k < h; k++) {
+		ok = memcmp(region + k * row_len, ref + ((size_t)(y + k) * img->width + x) * desc->channels, row_len) == 0;
+	}
+	conf_expect(res, img, desc, ok, "SLO_decode_region differs");
+	free(region);
+}
+
+/* Encode and decode through SLO_encode_ex and SLO_decode_ex, once from an
+arena and once from a pool with a block for each of the (at most 4) live
+allocations. SLO_decode_region_ex and SLO_encode_into_ex take their memory
+from the same allocator; SLO_decode_scaled_ex only from the arena, as its rows
+of sums need not fit into a block. */
+
+static void conf_check_ex(
+	const conf_image_t *img, const SLO_desc *desc, conf_result_t *res,
+	const unsigned char *pixels, const unsigned char *bytes, size_t len, const unsigned char *ref
+) {
+	size_t px_len = (size_t)img->width * img->height * desc->channels;
+	size_t block = SLO_encode_bound(desc) > px_len ? SLO_encode_bound(desc) : px_len;
+	size_t capacity = 16 * (block + 64);
+	unsigned char *buffer = (unsigned char *)conf_alloc(capacity);
+	unsigned char *encoded, *decoded, *into = (unsigned char *)conf_alloc(block + 64);
+	SLO_allocator allocator;
+	SLO_arena arena;
+	SLO_pool pool;
+	SLO_desc d;
+	size_t other_len;
+	int i, blocks = 0;
+
+	for (i = 0; i < 2; i++) {
+		if (i == 0) {
+			SLO_arena_init(&arena, buffer, capacity);
+			allocator = SLO_arena_allocator(&arena);
+		}
+		else {
+			SLO_pool_init(&pool, buffer, capacity, block);
+			allocator = SLO_pool_allocator(&pool);
+			blocks = conf_pool_blocks(&pool);
+		}
+
+		encoded = (unsigned char *)SLO_encode_ex(pixels, desc, &other_len, 2, &allocator);
+		conf_expect(res, img, desc, encoded && other_len == len && memcmp(encoded, bytes, len) == 0, i ? "SLO_encode_ex with a pool differs" : "SLO_encode_ex with an arena differs");
+		decoded = (unsigned char *)SLO_decode_ex(bytes, len, &d, 0, 2, &allocator);
+		conf_expect(res, img, desc, decoded && memcmp(decoded, ref, px_len) == 0, i ? "SLO_decode_ex with a pool differs" : "SLO_decode_ex with an arena differs");
+		if (encoded) {
+			allocator.free(allocator.user, encoded);
+		}
+		if (decoded) {
+			allocator.free(allocator.user, decoded);
+		}
+
+		other_len = SLO_encode_into_ex(pixels, desc, into, SLO_encode_bound(desc), &allocator);
+		conf_expect(res, img, desc, other_len == len && memcmp(into, bytes, len) == 0, i ? "SLO_encode_into_ex with a pool differs" : "SLO_encode_into_ex with an arena differs");
+		decoded = (unsigned char *)SLO_decode_region_ex(bytes, len, &d, 0, 0, 0, img->width, img->height, 2, &allocator);
+		conf_expect(res, img, desc, decoded && memcmp(decoded, ref, px_len) == 0, i ? "SLO_decode_region_ex with a pool differs" : "SLO_decode_region_ex with an arena differs");
+		if (decoded) {
+			allocator.free(allocator.user, decoded);
+		}
+		if (i == 0) {
+			decoded = (unsigned char *)SLO_decode_scaled_ex(bytes, len, &d, 0, 1, 2, &allocator);
+			conf_expect(res, img, desc, decoded && memcmp(decoded, ref, px_len) == 0, "SLO_decode_scaled_ex with an arena differs");
+		}
+	}
+
+	conf_expect(res, img, desc, conf_pool_blocks(&pool) == blocks, "SLO_pool lost blocks");
+	free(into);
+	free(buffer);
+}
+
+static void conf_check(const conf_image_t *img, const SLO_desc *desc, conf_result_t *res) {
+	size_t count = (size_t)img->width * img->height;
+	size_t row_len = (size_t)img->width * desc->channels;
+	size_t px_len = count * desc->channels;
+	size_t stride = row_len + 3;
+	size_t len, other_len, i;
+	unsigned char *pixels = (unsigned char *)conf_alloc(px_len);
+	unsigned char *ref = (unsigned char *)conf_alloc(px_len);
+	unsigned char *other = (unsigned char *)conf_alloc((img->height - 1) * stride + row_len);
+	SLO_rgba_t *q = (SLO_rgba_t *)conf_alloc(count * sizeof(SLO_rgba_t));
+	unsigned char *bytes, *encoded, max_error[4], ref_error[4] = {0};
+	const char *error;
+	SLO_encoder enc;
+	SLO_stats stats;
+	SLO_desc d;
+	unsigned long long stats_bytes, stats_pixels;
+	int y, k, ok, err;
+
+	for (i = 0; i < count; i++) {
+		memcpy(pixels + i * desc->channels, img->rgba + i * 4, desc->channels);
+	}
+
+	bytes = (unsigned char *)SLO_encode64(pixels, desc, &len);
+	conf_expect(res, img, desc, bytes != NULL, "SLO_encode failed");
+	if (!bytes) {
+		goto done;
+	}
+
+	error = conf_ref_decode(bytes, len, &d, q);
+	conf_expect(res, img, desc, error == NULL, error);
+	if (error) {
+		goto done;
+	}
+	conf_expect(res, img, desc, conf_quantized(pixels, q, desc, count), "pixels differ from the quantized input");
+	conf_dequant(q, &d, ref);
+
+	for (i = 0; i < px_len; i++) {
+		k = i % desc->channels;
+		err = ref[i] > pixels[i] ? ref[i] - pixels[i] : pixels[i] - ref[i];
+		ref_error[k] = err > ref_error[k] ? err : ref_error[k];
+	}
+	ok = SLO_measure_error(bytes, len, pixels, max_error) && memcmp(max_error, ref_error, 4) == 0;
+	conf_expect(res, img, desc, ok, "SLO_measure_error differs");
+
+	ok = SLO_measure_stats(bytes, len, &d, &stats);
+	stats_bytes = stats.header_bytes + sizeof(SLO_padding);
+	stats_pixels = 0;
+	for (k = 0; ok && k < SLO_STAT_OPS; k++) {
+		stats_bytes += stats.bytes[k];
+		stats_pixels += stats.pixels[k];
+	}
+	conf_expect(res, img, desc, ok && stats_bytes == len && stats_pixels == count, "SLO_measure_stats differs");
+
+	/* The other encoders */
+	if (desc->strip_height) {
+		encoded = (unsigned char *)SLO_encode_parallel(pixels, desc, &other_len, 4);
+		ok = encoded && other_len == len && memcmp(encoded, bytes, len) == 0;
+		conf_expect(res, img, desc, ok, "SLO_encode_parallel differs");
+		free(encoded);
+	}
+	else {
+		encoded = (unsigned char *)conf_alloc(SLO_encode_bound(desc));
+		ok = SLO_encode_into(pixels, desc, encoded, len) == len && memcmp(encoded, bytes, len) == 0;
+		conf_expect(res, img, desc, ok, "SLO_encode_into differs");
+		conf_expect(res, img, desc, SLO_encode_into(pixels, desc, encoded, len - 1) == SLO_ENCODE_MORE_SPACE, "SLO_encode_into overflows");
+
+		/* Rows pushed 1, 2, 3... at a time */
+		ok = SLO_encoder_init_buffer(&enc, desc, encoded, SLO_encode_bound(desc));
+		for (y = 0, k = 1; ok && y < img->height; y += k, k++) {
+			k = k < img->height - y ? k : img->height - y;
+			ok = SLO_encoder_push_rows(&enc, pixels + y * row_len, k, 0);
+		}
+		ok = ok && SLO_encoder_finish(&enc) && enc.len == len && memcmp(encoded, bytes, len) == 0;
+		conf_expect(res, img, desc, ok, "SLO_encoder differs");
+		free(encoded);
+	}
+
+	conf_check_ex(img, desc, res, pixels, bytes, len, ref);
+
+	/* The other decoders */
+	encoded = (unsigned char *)SLO_decode64(bytes, len, &d, 0);
+	conf_expect(res, img, desc, encoded && memcmp(encoded, ref, px_len) == 0, "SLO_decode differs");
+	free(encoded);
+
+	/* Out of range quality and index_bits bytes in the extension block */
+	if (bytes[13] & SLO_HEADER_EXT) {
+		for (k = 0; k < 2; k++) {
+			size_t at = k ? 21 : 19;
+			unsigned char keep = bytes[at];
+			bytes[at] = k ? 5 : 255;
+			encoded = (unsigned char *)SLO_decode64(bytes, len, &d, 0);
+			conf_expect(res, img, desc, encoded == NULL, "SLO_decode accepts a bad header");
+			free(encoded);
+			bytes[at] = keep;
+		}
+	}
+
+	encoded = (unsigned char *)SLO_decode_parallel(bytes, len, &d, 0, 4);
+	conf_expect(res, img, desc, encoded && memcmp(encoded, ref, px_len) == 0, "SLO_decode_parallel differs");
+	free(encoded);
+
+	ok = SLO_decode_into(bytes, len, &d, 0, other, (img->height - 1) * stride + row_len, stride, 1);
+	for (y = 0; ok && y < img->height; y++) {
+		ok = memcmp(other + y * stride, ref + y * row_len, row_len) == 0;
+	}
+	conf_expect(res, img, desc, ok, "SLO_decode_into differs");
+
+	ok = conf_stream_decode(bytes, len, other, row_len) && memcmp(other, ref, px_len) == 0;
+	conf_expect(res, img, desc, ok, "SLO_decoder differs");
+
+	for (k = 1; k <= 8; k *= 2) {
+		conf_check_scaled(img, desc, res, bytes, len, ref, k);
+	}
+
+	conf_check_region(img, desc, res, bytes, len, ref, 0, 0, img->width, img->height);
+	conf_check_region(img, desc, res, bytes, len, ref, 0, 0, img->width, 1);
+	conf_check_region(img, desc, res, bytes, len, ref, img->width - 1, img->height - 1, 1, 1);
+	conf_check_region(img, desc, res, bytes, len, ref, img->width / 3, img->height / 3, (img->width + 1) / 2, (img->height + 1) / 2);
+
+done:
+	free(bytes);
+	free(pixels);
+	free(ref);
+	free(other);
+	free(q);
+}
+
+/* The combinations of settings each image is checked with: channels,
+quality, recon, index size, strip height and the mode (exact, tolerance,
+bounded), counted like the digits of a number. conf_desc sets up desc for
+combination c, or returns 0 if it is to be skipped. conf_run returns the number
+of failed checks. */
+
+#define CONF_CONFIGS (2 * 4 * 3 * 3 * 3 * 3)
+
+static int conf_desc(int c, const conf_image_t *img, SLO_desc *desc) {
+	static const int index_sizes[] = {64, 256, 1024};
+	static const int strip_heights[] = {0, 1, 5};
+	int mode = c / 216;
+
+	memset(desc, 0, sizeof(SLO_desc));
+	desc->width = img->width;
+	desc->height = img->height;
+	desc->channels = 3 + c % 2;
+	desc->quality = SLO_QUALITY_LOSSLESS + c / 2 % 4;
+	desc->recon = c / 8 % 3;
+	desc->index_size = index_sizes[c / 24 % 3];
+	desc->strip_height = strip_heights[c / 72 % 3];
+	desc->tolerance = mode == 1 ? 3 : 0;
+	desc->bounded = mode == 2;
+	memset(desc->max_abs_error, 8, 3);
+
+	/* Lossless images have no bits to recon. Skip the bounds that the
+	quantization alone exceeds. */
+	return
+		!(desc->quality == SLO_QUALITY_LOSSLESS && desc->recon != SLO_RECON_SHIFT) &&
+		SLO_encode_bound(desc) != 0;
+}
+
+/* Encode all images with the settings c as one batch, with an invalid item
+in between, and compare each to SLO_encode64, and the batch to one encoded
+with an arena. Then decode the batch again with SLO_decode_batch and compare
+each image to SLO_decode64. */
+
+static void conf_check_batch(int c, conf_image_t *images, int len, conf_result_t *res) {
+	SLO_encode_item items[CONF_IMAGES + 1];
+	SLO_decode_item decode_items[CONF_IMAGES + 1];
+	unsigned char *pixels[CONF_IMAGES], *decoded;
+	SLO_desc d;
+	size_t offsets[CONF_IMAGES + 2], arena_offsets[CONF_IMAGES + 2];
+	size_t px_len, single_len, capacity = 64, i;
+	unsigned char *batch, *single, *buffer;
+	SLO_allocator allocator;
+	SLO_arena arena;
+	int n = 0, k, ok;
+
+	for (k = 0; k < len; k++, n++) {
+		if (k == len / 2) {
+			memset(&items[n], 0, sizeof(SLO_encode_item));
+			n++;
+		}
+		if (!conf_desc(c, &images[k], &items[n].desc)) {
+			pixels[k] = NULL;
+			items[n].pixels = NULL;
+			continue;
+		}
+		px_len = (size_t)images[k].width * images[k].height;
+		pixels[k] = (unsigned char *)conf_alloc(px_len * items[n].desc.channels);
+		for (i = 0; i < px_len; i++) {
+			memcpy(pixels[k] + i * items[n].desc.channels, images[k].rgba + i * 4, items[n].desc.channels);
+		}
+		items[n].pixels = pixels[k];
+		capacity += SLO_encode_bound(&items[n].desc);
+	}
+
+	batch = (unsigned char *)SLO_encode_batch(items, n, offsets, 4, NULL);
+	conf_expect(res, &images[0], &items[0].desc, batch != NULL, "SLO_encode_batch failed");
+	for (k = 0; batch && k < n; k++) {
+		single = items[k].pixels ? (unsigned char *)SLO_encode64(items[k].pixels, &items[k].desc, &single_len) : NULL;
+		ok = single
+			? offsets[k + 1] - offsets[k] == single_len && memcmp(batch + offsets[k], single, single_len) == 0
+			: offsets[k + 1] == offsets[k];
+		conf_expect(res, &images[k > len / 2 ? k - 1 : k], &items[k].desc, ok, "SLO_encode_batch differs");
+		free(single);
+		decode_items[k].data = batch + offsets[k];
+		decode_items[k].size = offsets[k + 1] - offsets[k];
+	}
+
+	/* The output takes the worst case size of every image, so that is all
+	the arena needs room for. On one thread, the images are packed as they
+	are encoded instead of moved afterwards. */
+	buffer = (unsigned char *)conf_alloc(capacity);
+	SLO_arena_init(&arena, buffer, capacity);
+	allocator = SLO_arena_allocator(&arena);
+	single = (unsigned char *)SLO_encode_batch(items, n, arena_offsets, 1, &allocator);
+	ok = batch && single && memcmp(arena_offsets, offsets, (n + 1) * sizeof(size_t)) == 0 && memcmp(single, batch, offsets[n]) == 0;
+	conf_expect(res, &images[0], &items[0].desc, ok, "SLO_encode_batch with an arena differs");
+	free(buffer);
+
+	decoded = batch ? (unsigned char *)SLO_decode_batch(decode_items, n, 0, 4, NULL) : NULL;
+	conf_expect(res, &images[0], &items[0].desc, decoded != NULL, "SLO_decode_batch failed");
+	for (k = 0; decoded && k < n; k++) {
+		single = (unsigned char *)SLO_decode64(decode_items[k].data, decode_items[k].size, &d, 0);
+		ok = single
+			? decode_items[k].ok && memcmp(decoded + decode_items[k].offset, single, (size_t)d.width * d.height * d.channels) == 0
+			: !decode_items[k].ok;
+		conf_expect(res, &images[k > len / 2 ? k - 1 : k], &items[k].desc, ok, "SLO_decode_batch differs");
+		free(single);
+	}
+	free(decoded);
+	free(batch);
+	for (k = 0; k < len; k++) {
+		free(pixels[k]);
+	}
+}
+
+static int conf_run(void) {
+	conf_image_t images[CONF_IMAGES];
+	conf_result_t res, total;
+	SLO_desc desc;
+	int len, i, c;
+
+	len = conf_corpus(images);
+	total.checks = total.failed = 0;
+	for (i = 0; i < len; i++) {
+		res.checks = res.failed = 0;
+		for (c = 0; c < CONF_CONFIGS; c++) {
+			if (conf_desc(c, &images[i], &desc)) {
+				conf_check(&images[i], &desc, &res);
+			}
+		}
+		printf("%-16s %4dx%-4d %6d checks, %d failed\n", images[i].name, images[i].width, images[i].height, res.checks, res.failed);
+		total.checks += res.checks;
+		total.failed += res.failed;
+	}
+
+	res.checks = res.failed = 0;
+	for (c = 0; c < CONF_CONFIGS; c++) {
+		conf_check_batch(c, images, len, &res);
+	}
+	printf("%-16s %9s %6d checks, %d failed\n", "batch", "", res.checks, res.failed);
+	total.checks += res.checks;
+	total.failed += res.failed;
+
+	for (i = 0; i < len; i++) {
+		free(images[i].rgba);
+	}
+	printf("conformance: %d checks, %d failed\n", total.checks, total.failed);
+	return total.failed;
+}
+
+int main(int argc, char **argv) {
+	bench_opts_t opts;
+	bench_group_t *groups;
+	const char *json_path = NULL;
+	int i, n = 0, first, conformance = 0;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.runs = 10;
+
+	groups = (bench_group_t *)calloc(argc, sizeof(bench_group_t));
+	if (!groups) {
+		return 1;
+	}
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			opts.runs = atoi(argv[++i]);
+			if (opts.runs < 1) {
+				opts.runs = 1;
+			}
+		}
+		else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			json_path = argv[++i];
+		}
+		else if (strcmp(argv[i], "--nostb") == 0) {
+			opts.no_stb = 1;
+		}
+		else if (strcmp(argv[i], "-l") == 0) {
+			opts.ladder = 1;
+		}
+		else if (strcmp(argv[i], "-q") == 0) {
+			opts.quiet = 1;
+		}
+		else if (strcmp(argv[i], "--conformance") == 0) {
+			conformance = 1;
+		}
+		else {
+			argv[++n] = argv[i];
+		}
+	}
+
+	if (conformance) {
+		free(groups);
+		return conf_run() ? 1 : 0;
+	}
+
+	if (n == 0) {
+		puts("Usage: slobench [options] <directory or file.png> ...");
+		puts("       slobench --conformance");
+		puts("Options:");
+		puts("  -r <runs>     encode and decode each image this many times, default 10");
+		puts("  -j <file>     write all results as JSON to file, - for stdout");
+		puts("  --nostb       don't run the stb_image/stb_image_write baseline");
+		puts("  -l            also decode with the old if/else opcode ladder");
+		puts("  -q            only print the totals per argument");
+		puts("  --conformance check the en- and decoders on generated edge cases");
+		puts("                against a reference decoder, instead of benchmarking");
+		puts("Examples:");
+		puts("  slobench images/");
+		puts("  slobench -r 50 -j results.json --nostb images/ input.png");
+		exit(1);
+	}
+
+	if (json_path) {
+		opts.json = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+		if (!opts.json) {
+			printf("Couldn't open %s\n", json_path);
+			exit(1);
+		}
+		if (opts.json == stdout) {
+			opts.quiet = 2;
+		}
+	}
+
+	for (i = 1; i <= n; i++) {
+		bench_path(argv[i], &opts, &groups[i]);
+		if (opts.quiet < 2) {
+			bench_print_group(&groups[i], argv[i]);
+		}
+	}
+
+	if (opts.json) {
+		fprintf(opts.json, "{\n\t\"runs\": %d,\n\t\"images\": [", opts.runs);
+		for (i = 1, first = 1; i <= n; i++) {
+			bench_json_group(opts.json, &groups[i], argv[i], first);
+			first = first && groups[i].len == 0;
+		}
+		fprintf(opts.json, "\n\t],\n\t\"totals\": [");
+		for (i = 1; i <= n; i++) {
+			bench_json_summary(opts.json, &groups[i], argv[i], i == 1);
+		}
+		fprintf(opts.json, "\n\t]\n}\n");
+		if (opts.json != stdout) {
+			fclose(opts.json);
+		}
+	}
+
+	for (i = 1; i <= n; i++) {
+		int k;
+		for (k = 0; k < groups[i].len; k++) {
+			free(groups[i].images[k].path);
+		}
+		free(groups[i].images);
+	}
+	free(groups);
+	return 0;
+}
@@ -5,10 +5,15 @@ Command line tool to convert between png <> SLO format
 Requires:
 	-"stb_image.h" (https://github.com/nothings/stb/blob/master/stb_image.h)
 	-"stb_image_write.h" (https://github.com/nothings/stb/blob/master/stb_image_write.h)
-	-"SLO.h" (https://github.com/skandau/SLO.h)
+	-"slo.h" (https://github.com/skandau/SLO.h)
 
 Compile with: 
-	gcc SLOconv.c -std=c99 -O3 -o SLOconv
+	gcc SLOconv.c -std=c99 -O3 -pthread -o SLOconv
+
+With --stats the time taken to load and save the image is printed, and how
+many chunks and bytes each op of the SLO image (input or output) takes. The
+stats are counted from the bytes in memory that were just decoded or encoded,
+not read back from disk.
 
 -- LICENSE: MIT License
 
@@ -34,6 +39,8 @@ SOFTWARE.
 */
 
 
+#define _POSIX_C_SOURCE 199309L
+
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_ONLY_PNG
 #define STBI_NO_LINEAR
@@ -43,21 +50,97 @@ SOFTWARE.
 #include "stb_image_write.h"
 
 #define SLO_IMPLEMENTATION
-#include "SLO.h"
+#include "slo.h"
+
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <time.h>
+#endif
 
 
 #define STR_ENDS_WITH(S, E) (strcmp(S + strlen(S) - (sizeof(E)-1), E) == 0)
 
+static double conv_time(void) {
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+static unsigned char *read_file(const char *path, size_t *size) {
+	FILE *f = fopen(path, "rb");
+	unsigned char *data = NULL;
+	long len;
+
+	if (!f) {
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	data = len > 0 ? malloc(len) : NULL;
+	if (data && fread(data, 1, len, f) != (size_t)len) {
+		free(data);
+		data = NULL;
+	}
+	fclose(f);
+	*size = len;
+	return data;
+}
+
+static void print_stats(const char *path, const void *data, size_t size) {
+	static const char *names[SLO_STAT_OPS] = {"index", "index_long", "diff", "luma", "run", "rgb", "rgba"};
+	SLO_desc desc;
+	SLO_stats stats;
+
+	if (!SLO_measure_stats(data, size, &desc, &stats)) {
+		printf("Couldn't read stats of %s\n", path);
+		return;
+	}
+
+	double px = (double)desc.width * desc.height;
+	printf("%s: %ux%u, %d channels, %zu bytes, %.3f bits per pixel\n", path, desc.width, desc.height, desc.channels, size, size * 8 / px);
+	printf("%-12s %12s %12s %12s %7s\n", "op", "chunks", "bytes", "pixels", "pixels%");
+	printf("%-12s %12s %12llu\n", "header", "", stats.header_bytes);
+	for (int i = 0; i < SLO_STAT_OPS; i++) {
+		printf(
+			"%-12s %12llu %12llu %12llu %6.2f%%\n", names[i],
+			stats.chunks[i], stats.bytes[i], stats.pixels[i], stats.pixels[i] * 100 / px
+		);
+	}
+	printf(
+		"index hit rate %.2f%%, average run length %.2f\n",
+		(stats.pixels[SLO_STAT_INDEX] + stats.pixels[SLO_STAT_INDEX_LONG]) * 100 / px,
+		stats.chunks[SLO_STAT_RUN] ? (double)stats.pixels[SLO_STAT_RUN] / stats.chunks[SLO_STAT_RUN] : 0
+	);
+}
+
 int main(int argc, char **argv) {
+	int stats = argc > 1 && strcmp(argv[1], "--stats") == 0;
+	if (stats) {
+		argv++;
+		argc--;
+	}
+
 	if (argc < 3) {
-		puts("Usage: SLOconv <infile> <outfile>");
+		puts("Usage: SLOconv [--stats] <infile> <outfile>");
 		puts("Examples:");
 		puts("  SLOconv input.png output.slo");
 		puts("  SLOconv input.slo output.png");
+		puts("  SLOconv --stats input.png output.slo");
 		exit(1);
 	}
 
-	void *pixels = NULL;
+	double t0 = conv_time();
+	void *pixels = NULL, *in_bytes = NULL, *out_bytes = NULL;
+	size_t in_size = 0, out_size = 0;
 	int w, h, channels;
 	if (STR_ENDS_WITH(argv[1], ".png")) {
 		if(!stbi_info(argv[1], &w, &h, &channels)) {
@@ -74,7 +157,15 @@ int main(int argc, char **argv) {
 	}
 	else if (STR_ENDS_WITH(argv[1], ".slo")) {
 		SLO_desc desc;
-		pixels = SLO_read(argv[1], &desc, 0);
+
+		// With --stats the file is kept in memory to count its chunks
+		if (stats) {
+			in_bytes = read_file(argv[1], &in_size);
+			pixels = in_bytes ? SLO_decode64(in_bytes, in_size, &desc, 0) : NULL;
+		}
+		else {
+			pixels = SLO_read(argv[1], &desc, 0);
+		}
 		channels = desc.channels;
 		w = desc.width;
 		h = desc.height;
@@ -85,17 +176,24 @@ int main(int argc, char **argv) {
 		exit(1);
 	}
 
+	double t1 = conv_time();
 	int encoded = 0;
 	if (STR_ENDS_WITH(argv[2], ".png")) {
 		encoded = stbi_write_png(argv[2], w, h, channels, pixels, 0);
 	}
 	else if (STR_ENDS_WITH(argv[2], ".slo")) {
-		encoded = SLO_write(argv[2], pixels, &(SLO_desc){
+		out_bytes = SLO_encode64(pixels, &(SLO_desc){
 			.width = w,
 			.height = h, 
 			.channels = channels,
 			.colorspace = SLO_SRGB
-		});
+		}, &out_size);
+
+		FILE *f = out_bytes ? fopen(argv[2], "wb") : NULL;
+		if (f) {
+			encoded = fwrite(out_bytes, 1, out_size, f) == out_size;
+			encoded = fclose(f) == 0 && encoded;
+		}
 	}
 
 	if (!encoded) {
@@ -103,6 +201,19 @@ int main(int argc, char **argv) {
 		exit(1);
 	}
 
+	if (stats) {
+		double t2 = conv_time();
+		printf("load %.3f ms, save %.3f ms\n", (t1 - t0) * 1e3, (t2 - t1) * 1e3);
+		if (in_bytes) {
+			print_stats(argv[1], in_bytes, in_size);
+		}
+		if (out_bytes) {
+			print_stats(argv[2], out_bytes, out_size);
+		}
+	}
+
+	free(in_bytes);
+	free(out_bytes);
 	free(pixels);
 	return 0;
 }